@@ -41,15 +41,70 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <ctype.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Images are converted in parallel using Win32 threads on Windows, and
+// POSIX threads anywhere else.
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOGDI
+    #include <windows.h>
+    #include <process.h>
+    #include <direct.h>
+    #include <psapi.h>
+    #ifdef _MSC_VER
+        #pragma comment(lib, "psapi.lib")
+    #endif
+#else
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <glob.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <fcntl.h>
+    #include <time.h>
+#endif
+
+// SIMD kernels are available only on x86 / x64 targets: on any other
+// architecture the scalar kernels are used.
+// They can also be disabled by defining IMG2TILE_NO_SIMD.
+#if ( defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__) ) && !defined(IMG2TILE_NO_SIMD)
+    #define IMG2TILE_X86
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TARGET_SSE2
+        #define TARGET_AVX2
+    #else
+        #include <cpuid.h>
+        #define TARGET_SSE2 __attribute__((target("sse2")))
+        #define TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
+// Hardware performance counters are read only on Linux (see 
+// --perf-counters). They can also be disabled by defining IMG2TILE_NO_PERF.
+#if defined(__linux__) && !defined(IMG2TILE_NO_PERF)
+    #define IMG2TILE_PERF
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+#endif
 
 /****************************************************************************
  ** RESIDENT VARIABLES SECTION
  ****************************************************************************/
 
-// Maximum number of images
-
-#define MAX_FILENAMES                   256
-
 // Error levels.
 
 #define ERL_WRONG_OPTIONS               1
@@ -61,6 +116,7 @@
 #define ERL_CANNOT_CONVERT_HEIGHT       8
 #define ERL_CANNOT_OPEN_HEADER          9
 #define ERL_CANNOT_CONVERT_COLORS       10
+#define ERL_GOLDEN_MISMATCH             11
 
 // This is the default palette for supported retrocomputers.
 // Data taken from: 
@@ -100,7 +156,7 @@ NamedRGB COLORS[] = {
     { "PEACH", { 0xff, 0xda, 0xb9 } }
 };
 
-// These are the default values for running the program.
+// These are the default values for running the program (and for each job).
 
 Configuration configuration = {
     8,  /* width */
@@ -112,36 +168,104 @@ Configuration configuration = {
     1,  /* luminance_threshold */
     0,  /* bank number */
     0,  /* multicolor */
-    -1  /* background */
+    -1, /* background */
+    24, /* row_size */
+    0,  /* bgr */
+    0   /* luminance */
 };
 
-// Pointer to the name of the file with the image to be processed.
+// Jobs to be executed: the one given by the command line and/or the ones
+// given by the manifest.
+
+Job* jobs_list = NULL;
+
+// Count of jobs.
+
+int jobs_count = 0;
+
+// Pointer to the name of the file with the jobs to be executed (manifest).
+
+char* filename_manifest = NULL;
+
+// Images used by all the jobs, each one decoded only once.
+
+SharedImage* shared_images = NULL;
+
+// Count of images used by all the jobs.
+
+int shared_images_count = 0;
+
+// Tasks to be executed: the conversion of an image of a job each.
+
+ConversionTask* conversion_tasks = NULL;
+
+// Pointer to the name of the socket where requests are served (see --serve).
+
+char* filename_socket = NULL;
+
+// Is the program serving requests? In that case, errors must not terminate
+// the process: they abandon the request, and are reported to the client.
 
-char* filename_in[MAX_FILENAMES];
+int serving = 0;
 
-// Array with starting tile for each image
+// Where to go back when the request being served is abandoned.
 
-int starting_tile[MAX_FILENAMES];
+jmp_buf* request_abort = NULL;
 
-// Array with widths (in tiles) for each image
+// Error level of the request being served (set by any thread).
 
-int width_in_tiles[MAX_FILENAMES];
+volatile int request_error = 0;
 
-// Array with heights (in tiles) for each image
+// Images decoded by the server, to avoid decoding them again.
 
-int height_in_tiles[MAX_FILENAMES];
+CachedImage* decode_cache = NULL;
 
-// Count of images.
+// Count of slots (used or not) of the decoded images.
 
-int filename_in_count = 0;
+int decode_cache_count = 0;
 
-// Pointer to the name of the file with the tile data.
+// Maximum size of the images kept decoded by the server (in bytes).
 
-char* filename_out = NULL;
+long long decode_cache_limit = 268435456;
 
-// Pointer to the name of the file with the C headers
+// Size of the images kept decoded by the server (in bytes).
 
-char* filename_header = NULL;
+long long decode_cache_bytes = 0;
+
+// Counter used to find the least recently used decoded image.
+
+unsigned long decode_cache_clock = 0;
+
+// Pointer to the name of the directory where converted images are kept
+// (see --cache-dir).
+
+char* cache_directory = NULL;
+
+// Version of the converted images kept into the cache directory: it must be
+// changed whenever the conversion (or the format of the files) changes.
+
+#define CACHE_VERSION                   2
+
+// First bytes of the files with the converted images ("I2TC").
+
+#define CACHE_MAGIC                     0x43543249
+
+// Images larger than this (in bytes, once decoded) are converted a band of 
+// rows at a time, without decoding them as a whole (see --stream). A 
+// negative value means never.
+
+long long stream_bytes = -1;
+
+// Number of images found (or not) into the cache directory.
+
+volatile long cache_hits = 0;
+
+volatile long cache_misses = 0;
+
+// Number of temporary files named so far, so that each one has its own name
+// (more jobs can write the same file).
+
+volatile long temporary_files = 0;
 
 // Verbose?
 
@@ -151,6 +275,332 @@ int verbose = 0;
 
 int debug = 0;
 
+// Maximum number of characters for each line of the preview of the 
+// converted images (see -v): wider images are shown a block of pixels for
+// each character. Zero means no limit.
+
+int preview_columns = 0;
+
+// Formats of the statistics of the execution (see --stats).
+
+#define STATISTICS_NONE                 0
+#define STATISTICS_TEXT                 1
+#define STATISTICS_JSON                 2
+
+// How the statistics of the execution are shown (if they are).
+
+int statistics_format = STATISTICS_NONE;
+
+// Phases of the conversion measured by the statistics (see --stats) and by
+// the performance counters (see --perf-counters).
+
+#define PHASE_DECODE                    0
+#define PHASE_PALETTE                   1
+#define PHASE_MATCHING                  2
+#define PHASE_CONVERSION                3
+#define PHASE_OUTPUT                    4
+#define PHASE_HEADER                    5
+#define PHASES_COUNT                    6
+
+const char* PHASE_NAMES[] = { "decode", "palette", "matching", "conversion", "output", "header" };
+
+// Count the events of the processor during each phase (see --perf-counters)?
+
+int perf_counters = 0;
+
+// Events of the processor counted by the performance counters.
+
+#define PERF_CYCLES                     0
+#define PERF_INSTRUCTIONS               1
+#define PERF_CACHE_MISSES               2
+#define PERF_BRANCH_MISSES              3
+#define PERF_COUNTERS_COUNT             4
+
+// Events counted during each phase, by all the threads.
+
+volatile long long perf_events[PHASES_COUNT][PERF_COUNTERS_COUNT];
+
+// Events that could be counted by at least a thread and, if no event could
+// be counted, the reason why (as errno).
+
+volatile int perf_available[PERF_COUNTERS_COUNT];
+
+volatile int perf_error = 0;
+
+// Pointer to the name of the file where the trace of the execution is 
+// written (see --trace).
+
+char* filename_trace = NULL;
+
+// Run the benchmarks of the kernels, instead of converting images (see 
+// --benchmark)? The results can be compared with the ones of a previous 
+// run, written into the given file.
+
+int benchmark = 0;
+
+char* filename_benchmark_baseline = NULL;
+
+// Kernels measured by the benchmarks.
+
+#define BENCHMARK_LUMINANCE             0
+#define BENCHMARK_DISTANCE              1
+#define BENCHMARK_PALETTE               2
+#define BENCHMARK_HIRES                 3
+#define BENCHMARK_MULTICOLOR            4
+
+const char* BENCHMARK_KERNELS[] = {
+    "calculate_luminance",
+    "calculate_distance",
+    "extract_color_palette",
+    "convert_image_into_tiles",
+    "convert_image_into_multicolor_tiles"
+};
+
+// Colors of the synthetic images used by the benchmarks: each pixel is 
+// one of two colors, one of four colors or any color (noise).
+
+#define BENCHMARK_TWO_COLORS            0
+#define BENCHMARK_FOUR_COLORS           1
+#define BENCHMARK_NOISE                 2
+
+const char* BENCHMARK_DISTRIBUTIONS[] = {
+    "2-color",
+    "4-color",
+    "noise"
+};
+
+// Sizes (in pixels, for each side) of the synthetic images used by the 
+// benchmarks: from images that fit into the first level cache to images
+// that do not fit into any cache.
+
+const int BENCHMARK_SIZES[] = { 64, 512, 2048 };
+
+// Names of the instruction set levels, as shown by the benchmarks.
+
+const char* SIMD_NAMES[] = { "scalar", "sse2", "avx2" };
+
+// Each benchmark is repeated until it takes at least this time (in seconds)
+// and for at least the minimum number of repetitions (up to the maximum), 
+// after the repetitions used to warm up the caches.
+
+#define BENCHMARK_TIME                  0.1
+#define BENCHMARK_WARM_UP               2
+#define BENCHMARK_MINIMUM_REPETITIONS   5
+#define BENCHMARK_MAXIMUM_REPETITIONS   1000
+
+// Results of the kernels that are not used otherwise, so that they are not
+// optimized away by the compiler.
+
+volatile long benchmark_sink = 0;
+
+// Pointer to the name of the directory where the corpus of synthetic 
+// images is written (see --corpus).
+
+char* directory_corpus = NULL;
+
+// Formats of the images of the corpus, and their extensions.
+
+#define CORPUS_PPM                      0
+#define CORPUS_BMP                      1
+#define CORPUS_PNG                      2
+#define CORPUS_GIF                      3
+
+const char* CORPUS_FORMATS[] = { "ppm", "bmp", "png", "gif" };
+
+// Colors of the images of the corpus: two or four colors (as for the 
+// benchmarks) or photographic (gradients with some noise).
+
+#define CORPUS_TWO_COLORS               0
+#define CORPUS_FOUR_COLORS              1
+#define CORPUS_PHOTOGRAPHIC             2
+
+const char* CORPUS_DISTRIBUTIONS[] = { "2-color", "4-color", "photo" };
+
+// Sizes (width and height, in pixels) of the images of the corpus. The 
+// largest one (8K) is written only as indexed PNG, with two or four colors.
+
+const int CORPUS_SIZES[][2] = { { 64, 64 }, { 320, 200 }, { 1920, 1080 }, { 7680, 4320 } };
+
+#define CORPUS_SIZES_COUNT              4
+
+// Pointer to the name of the file with the hashes of the expected outputs 
+// (see --golden).
+
+char* filename_golden = NULL;
+
+// Table used to calculate the CRC of the chunks of PNG images (calculated
+// when first needed).
+
+unsigned int CRC32_TABLE[256];
+
+// Modes for removing duplicated tiles.
+
+#define DEDUPLICATE_NONE                0
+#define DEDUPLICATE_EXACT               1
+#define DEDUPLICATE_FLIPS               2
+
+// Where options are given: options of the whole execution can be given 
+// only on the command line or by a request to the server (not for a single
+// job of the manifest), and options that start the program in another mode
+// only on the command line.
+
+#define OPTIONS_COMMAND_LINE            0
+#define OPTIONS_REQUEST                 1
+#define OPTIONS_MANIFEST                2
+
+// Flip flags of the tile map: the tile must be drawn mirrored horizontally
+// and/or flipped vertically.
+
+#define FLIP_HORIZONTAL                 1
+#define FLIP_VERTICAL                   2
+
+// Number of threads used to convert images (0 means one for each processor).
+
+int jobs = 1;
+
+// Number of threads used to convert the rows of tiles of a single image.
+
+int band_jobs = 1;
+
+// Images with more pixels than this are converted by more threads, a row
+// of tiles at a time.
+
+int parallel_pixels = 1048576;
+
+// Portable threads and mutexes.
+
+#ifdef _WIN32
+    typedef HANDLE Thread;
+    typedef CRITICAL_SECTION Mutex;
+    #define THREAD_FUNCTION(_name) unsigned __stdcall _name(void* _argument)
+#else
+    typedef pthread_t Thread;
+    typedef pthread_mutex_t Mutex;
+    #define THREAD_FUNCTION(_name) void* _name(void* _argument)
+#endif
+
+// Portable variables with a copy for each thread.
+
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+// Mutex used to keep the output of each image together, when verbose.
+
+Mutex output_mutex;
+
+// Mutexes used to decode each shared image only once.
+
+Mutex* shared_images_mutex = NULL;
+
+// Mutex used to access the images decoded by the server.
+
+Mutex decode_cache_mutex;
+
+// Buffers of the spans recorded by the threads (see --trace), and how many
+// threads recorded them.
+
+TraceBuffer* volatile trace_buffers = NULL;
+
+volatile long trace_threads = 0;
+
+// When the trace started, and how many traces have been started: buffers 
+// of the previous traces are not used anymore.
+
+double trace_start = 0;
+
+int trace_generation = 0;
+
+// Buffer of the spans recorded by the current thread, and the trace it 
+// belongs to.
+
+THREAD_LOCAL TraceBuffer* thread_trace_buffer = NULL;
+
+THREAD_LOCAL int thread_trace_generation = 0;
+
+// Performance counters of the current thread (-1 if not available), if 
+// they have been opened (1) or they cannot be (-1), and the events counted
+// when the current phase started.
+
+THREAD_LOCAL int thread_perf_counters[PERF_COUNTERS_COUNT];
+
+THREAD_LOCAL int thread_perf_state = 0;
+
+THREAD_LOCAL long long thread_perf_start[PERF_COUNTERS_COUNT];
+
+// Buffer where the current thread keeps its output, if any (see 
+// print_output).
+
+THREAD_LOCAL OutputBuffer* thread_output = NULL;
+
+// Instruction set levels for the conversion kernels.
+
+#define SIMD_NONE                       0
+#define SIMD_SSE2                       1
+#define SIMD_AVX2                       2
+
+// Instruction set used by the conversion kernels (see detect_simd_level).
+
+int simd_level = SIMD_NONE;
+
+// This table reverses the order of the bits of a byte. Vector masks put the
+// leftmost pixel in the least significant bit, while on tiles the leftmost
+// pixel is the most significant bit of the mixel.
+
+#define REVERSE_BITS2(n)    n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define REVERSE_BITS4(n)    REVERSE_BITS2(n), REVERSE_BITS2(n + 2 * 16), REVERSE_BITS2(n + 1 * 16), REVERSE_BITS2(n + 3 * 16)
+#define REVERSE_BITS6(n)    REVERSE_BITS4(n), REVERSE_BITS4(n + 2 * 4), REVERSE_BITS4(n + 1 * 4), REVERSE_BITS4(n + 3 * 4)
+
+const unsigned char REVERSE_BITS[256] = {
+    REVERSE_BITS6(0), REVERSE_BITS6(2), REVERSE_BITS6(1), REVERSE_BITS6(3)
+};
+
+// This table reverses the order of the pairs of bits of a byte, that is 
+// the order of the pixels of a multicolor mixel.
+
+#define REVERSE_PAIRS2(n)   n, n + 64, n + 128, n + 192
+#define REVERSE_PAIRS4(n)   REVERSE_PAIRS2(n), REVERSE_PAIRS2(n + 16), REVERSE_PAIRS2(n + 32), REVERSE_PAIRS2(n + 48)
+#define REVERSE_PAIRS6(n)   REVERSE_PAIRS4(n), REVERSE_PAIRS4(n + 4), REVERSE_PAIRS4(n + 8), REVERSE_PAIRS4(n + 12)
+
+const unsigned char REVERSE_PAIRS[256] = {
+    REVERSE_PAIRS6(0), REVERSE_PAIRS6(1), REVERSE_PAIRS6(2), REVERSE_PAIRS6(3)
+};
+
+// These tables give the base and the extra bits of the lengths and of the
+// distances of the deflate format (used by PNG images), and the order of 
+// the lengths of the code used for the code lengths.
+
+const unsigned short DEFLATE_LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+const unsigned char DEFLATE_LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+const unsigned short DEFLATE_DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+const unsigned char DEFLATE_DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+const unsigned char DEFLATE_CODE_LENGTHS_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// This table gives the factor that scales grey values of PNG images with 
+// less than 8 bits to 8 bits (as stb_image does).
+
+const unsigned char PNG_GREY_SCALE[9] = { 0, 0xff, 0x55, 0, 0x11, 0, 0, 0, 0x01 };
+
 /****************************************************************************
  ** RESIDENT FUNCTIONS SECTION
  ****************************************************************************/
@@ -171,6 +621,11 @@ void usage_and_exit(int _level, int _argc, char* _argv[]) {
 
     int i;
 
+    // When serving, errors abandon the request instead of exiting.
+    if (request_abort != NULL) {
+        longjmp(*request_abort, _level);
+    }
+
     printf("\n");
     printf("\n");
     printf("img2tile - Utility to convert images into (a set of) tile(s)\n");
@@ -184,6 +639,8 @@ void usage_and_exit(int _level, int _argc, char* _argv[]) {
     printf("\n");
     printf(" -i <filename> input filename\n");
     printf("                  More than one file can be converted.\n");
+    printf("                  A directory converts all its images, and\n");
+    printf("                  wildcards ('*' and '?') can be used.\n");
     printf("                  Supported formats: \n");
     printf("                    JPEG (12 bpc not supported)\n");
     printf("                    PNG 1...16 bpc\n");
@@ -194,6 +651,7 @@ void usage_and_exit(int _level, int _argc, char* _argv[]) {
     printf("                    HDR (rgbE)\n");
     printf("                    PIC (Softimage)\n");
     printf("                    PNM (PPM / PGM binary)\n");
+    printf(" @<filename>   convert the inputs listed into the file (one for each line)\n");
     printf(" -o <filename> output filename\n");
     printf("\n");
     printf("[optional]\n");
@@ -210,642 +668,6035 @@ void usage_and_exit(int _level, int _argc, char* _argv[]) {
     printf(" -b <number>   set the bank number (used only with '-g')\n");
     printf(" -d            enable debugging (used only with '-v')\n");
     printf(" -g <filename> generate C headers of tile offsets \n");
+    printf(" -j <number>   convert images using <number> threads (0 = all processors)\n");
+    printf(" --jobs <filename> execute the jobs listed into the file (one for each line)\n");
+    printf(" --serve <socket>  serve conversion requests on a Unix domain socket\n");
+    printf(" --cache <megabytes> keep up to <megabytes> of decoded images (used only with '--serve')\n");
+    printf(" --client <socket> send the other options as a request to the server (must be the first option)\n");
+    printf(" --cache-dir <directory> keep the converted images into <directory>, and use them again\n");
+    printf(" --stream <megabytes> convert images larger than <megabytes> (once decoded) a band of rows at a time\n");
+    printf(" --preview-width <columns> show wider images a block of pixels for each character (used only with '-v')\n");
+    printf(" --stats[=json] show the time taken by each phase, and how much has been converted\n");
+    printf(" --perf-counters count the events of the processor during each phase (Linux only, implies '--stats')\n");
+    printf(" --trace <filename> write the timeline of the execution into <filename> (trace event format)\n");
+    printf(" --benchmark   measure the speed of the kernels on synthetic images, instead of converting\n");
+    printf(" --benchmark-compare <filename> measure the kernels, and compare with the results into <filename>\n");
+    printf(" --corpus <directory> write a corpus of synthetic images (and a manifest) into <directory>\n");
+    printf(" --golden <filename> compare the outputs with the hashes into <filename> (written if missing)\n");
     printf(" -l <lum>      threshold luminance\n");
+    printf(" -M <filename> generate a dependency file (for make) of the outputs\n");
+    printf(" -p <pixels>   split images larger than <pixels> between threads (used only with '-j')\n");
     printf(" -m            enable multicolor support\n");
     printf(" -R            reverse luminance threshold\n");
+    printf(" -u            remove duplicated tiles (the header will have a tile map)\n");
+    printf(" -U            remove duplicated tiles, also if mirrored or flipped\n");
     printf(" ");
 
     exit(_level);
 
 }
 
-// This function allows to parse the options entered on the command line. 
-// Options must start with a minus character ('-') and only the first letter 
-// is considered.
+// This function reports an error happened while converting, into any 
+// thread: the program exits, unless a request is being served. In that case
+// the error is recorded, and the request is abandoned when threads end.
 
-void parse_options(int _argc, char* _argv[]) {
+void conversion_error(int _level, int _argc, char* _argv[]) {
 
-    // Used as index.
-    int i, j, c;
+    if (serving) {
+        request_error = _level;
+        return;
+    }
 
-    // We check for each option...
-    for (i = 1; i < _argc; ++i) {
+    usage_and_exit(_level, _argc, _argv);
 
-        // Parse it only if begins with '-'
-        if (_argv[i][0] == '-') {
+}
 
-            switch (_argv[i][1]) {
-                case 'i': // "-i <filename>"
-                    filename_in[filename_in_count++] = _argv[i + 1];
-                    ++i;
-                    break;
-                case 'o': // "-o <filename>"
-                    filename_out = _argv[i + 1];
-                    ++i;
-                    break;
-                case 'l': // "-l <luminance>"
-                    configuration.luminance_threshold = atoi(_argv[i + 1]);
-                    ++i;
-                    break;
-                case 'b': // "-b <number>"
-                    configuration.bank = atoi(_argv[i + 1]);
-                    ++i;
-                    break;
-                case 'B': // "-B <color>"
-                    c = sizeof(COLORS) / sizeof(NamedRGB);
-                    for (j = 0; j < c; ++j) {
-                        if (stricmp(_argv[i + 1], COLORS[j].name) == 0) {
-                            configuration.background = j;
-                            break;
-                        }
-                    }
-                    if (j == c) {
-                        printf("Unknown color: %s", _argv[i+1]);
-                        usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
-                    }
-                    ++i;
-                    break;
-                case 'R': // "-R"
-                    configuration.reverse = 1;
-                    break;
-                case 'v': // "-v"
-                    verbose = 1;
-                    break;
-                case 'q': // "-q"
-                    verbose = 0;
-                    break;
-                case 'd': // "-d"
-                    debug = 1;
-                    break;
-                case 'm': // "-m"
-                    configuration.multicolor = 1;
-                    break;
-                case 'g': // "-g"
-                    filename_header = _argv[i + 1];
-                    ++i;
-                    break;
-                default:
-                    fprintf(stderr, "ERROR:: unknown option '%s'.\n", _argv[i]);
-                    usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
-            }
+// This function adds the name of an image to be processed, enlarging the
+// table of names when needed. The name must be allocated, since it is 
+// freed with the job.
 
-        }
+void add_filename(Job* _job, char* _filename) {
+
+    if (_job->filename_in_count == _job->filename_in_size) {
+        _job->filename_in_size = _job->filename_in_size ? _job->filename_in_size * 2 : 64;
+        _job->filename_in = realloc(_job->filename_in, sizeof(char*) * _job->filename_in_size);
     }
 
-}
+    _job->filename_in[_job->filename_in_count++] = _filename;
 
-// This function calculates the luminance of a color. 
-// By luminance we mean the modulus of the three-dimensional vector, drawn 
-// in the space composed of the three components (red, green and blue).
-// The returned value is normalized to the nearest 8-bit value.
+}
 
-int calculate_luminance(RGB _a) {
+// This function adds the name of a file (or directory) the inputs have been
+// read from: a list of inputs, a directory or the manifest. These are 
+// written into the dependency file as well (see -M). The name must be 
+// allocated, since it is freed with the job.
 
-    // Extract the vector's components 
-    // (each partecipate up to 1/3 of the luminance).
-    double red = (double)_a.red / 3;
-    double green = (double)_a.green / 3;
-    double blue = (double)_a.blue / 3;
+void add_source(Job* _job, char* _filename) {
 
-    // Calculate luminance using Pitagora's Theorem
-    return (int)sqrt(pow(red, 2) + pow(green, 2) + pow(blue, 2));
+    _job->filename_source = realloc(_job->filename_source, sizeof(char*) * (_job->filename_source_count + 1));
+    _job->filename_source[_job->filename_source_count++] = _filename;
 
 }
 
-// This function calculates the color distance between two colors(_a and _b).
-// By "distance" we mean the geometric distance between two points in a 
-// three-dimensional space, where each dimension corresponds to one of the 
-// components (red, green and blue). The returned value is normalized to 
-// the nearest 8-bit value.
+// This function returns a copy of the given path, with the given name 
+// appended (if not NULL).
 
-int calculate_distance(RGB _a, RGB _b) {
+char* copy_filename(char* _path, char* _name) {
 
-    // Extract the vector's components.
-    double red = (double)_a.red - (double)_b.red;
-    double green = (double)_a.green - (double)_b.green;
-    double blue = (double)_a.blue - (double)_b.blue;
+    size_t length = strlen(_path);
+    char* filename = malloc(length + (_name ? strlen(_name) + 2 : 1));
 
-    // Calculate distance using Pitagora's Theorem
-    return (int)sqrt(pow(red, 2) + pow(green, 2) + pow(blue, 2));
+    strcpy(filename, _path);
+    if (_name) {
+        if (length > 0 && _path[length - 1] != '/' && _path[length - 1] != '\\') {
+            filename[length++] = '/';
+        }
+        strcpy(filename + length, _name);
+    }
+
+    return filename;
 
 }
 
-// This function convert an image of (W,H) pixels in a set of (WT,HT) tiles.
-// Tiles will be drawn in a "contiguous" way, i.e. each row of tiles will
-// be drawn sequentially, and each column for each row the same. 
+// This function returns 1 if the name of the file has the extension of one
+// of the supported image formats.
 
-void convert_image_into_tiles(unsigned char *_source, Configuration * _configuration, Output * _output ) {
+int is_image_filename(char* _filename) {
 
-    // Position of the pixel in the original image
-    int image_x, image_y;
-    
-    // Position of the pixel, in terms of tiles
-    int tile_x, tile_y;
-    
-    // Position of the pixel, in terms of offset and bitmask
-    int offset, bitmask;
-
-    // Color of the pixel to convert
-    RGB rgb;
+    static const char* EXTENSIONS[] = {
+        "jpg", "jpeg", "png", "tga", "bmp", "psd", "gif", "hdr", "pic", "pnm", "ppm", "pgm"
+    };
 
-    int previous_tiles_count = _output->tiles_count;
-    int actual_tiles_count = _configuration->width_tiles * _configuration->height_tiles;
+    char* extension = strrchr(basename(_filename), '.');
+    int i;
 
-    if (_output->tiles_count == 0) {
+    if (extension == NULL) {
+        return 0;
+    }
 
-        // Calculate the surface area, in terms of tiles
-        _output->tiles_count = actual_tiles_count;
+    for (i = 0; i < sizeof(EXTENSIONS) / sizeof(char*); ++i) {
+        if (stricmp(extension + 1, EXTENSIONS[i]) == 0) {
+            return 1;
+        }
+    }
 
-        // Allocate enough memory
-        _output->tiles = malloc(_output->tiles_count * 8);
+    return 0;
 
-        // Clear the tiles.
-        memset(_output->tiles, 0, _output->tiles_count * 8);
+}
 
-    } else {
+// This function compares two file names, to add the files found into a 
+// directory (or by a pattern) always in the same order.
 
-        // Update the surface area, in terms of tiles
-        _output->tiles_count += actual_tiles_count;
+int compare_filenames(const void* _a, const void* _b) {
 
-        // Reallocate memory
-        _output->tiles = realloc(_output->tiles, _output->tiles_count * 8);
+    return strcmp(*(char**)_a, *(char**)_b);
 
-        // Clear the tiles.
-        memset(_output->tiles + previous_tiles_count*8, 0, actual_tiles_count * 8);
+}
 
-    }
+// This function returns 1 if the given path is a directory.
 
-    // Loop for all the source surface.
-    for (image_y = 0; image_y < _configuration->height; ++image_y) {
-        for (image_x = 0; image_x < _configuration->width; ++image_x) {
+int is_directory(char* _path) {
 
-            // Take the color of the pixel
-            rgb.red = *_source;
-            rgb.green = *(_source + 1);
-            rgb.blue = *(_source + 2);
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(_path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat status;
+    return stat(_path, &status) == 0 && S_ISDIR(status.st_mode);
+#endif
 
-            // Calculate the relative tile
-            tile_y = (image_y >> 3);
-            tile_x = (image_x >> 3);
-            
-            // Calculate the offset starting from the tile surface area
-            // and the bit to set.
-            offset = (tile_y * 8 * _configuration->width_tiles) + (tile_x * 8) + (image_y & 0x07);
-            bitmask = 1 << ( 7 - (image_x & 0x7) );
+}
 
-            // If the pixes has enough luminance value, it must be 
-            // considered as "on"; otherwise, it is "off".
-            if (calculate_luminance(rgb) >= _configuration->luminance_threshold) {
+// This function creates a directory, if it does not exist. It returns 0 if
+// the directory does not exist anyway.
 
-                // Inversion of "on"-"off" meaning.
-                if (_configuration->reverse) {
-                    *(_output->tiles + ( previous_tiles_count * 8 ) + offset) &= ~bitmask;
-                    if (verbose) {
-                        printf(" ");
-                    }
-                }
-                else {
-                    *(_output->tiles + ( previous_tiles_count * 8 ) + offset) |= bitmask;
-                    if (verbose) {
-                        printf("*");
-                    }
-                }
-            }
-            else {
+int create_directory(char* _path) {
 
-                // Inversion of "on"-"off" meaning.
-                if (!_configuration->reverse) {
-                    *(_output->tiles + ( previous_tiles_count * 8 ) + offset) &= ~bitmask;
-                    if (verbose) {
-                        printf(" ");
-                    }
-                }
-                else {
-                    *(_output->tiles + ( previous_tiles_count * 8 ) + offset) |= bitmask;
-                    if (verbose) {
-                        printf("*");
-                    }
-                }
+    if (!is_directory(_path)) {
+#ifdef _WIN32
+        _mkdir(_path);
+#else
+        mkdir(_path, 0777);
+#endif
+    }
+
+    return is_directory(_path);
+
+}
+
+// This function adds the images of a directory (only the files with the 
+// extension of a supported format), sorted by name.
+
+void add_filenames_from_directory(Job* _job, char* _path, int _argc, char* _argv[]) {
+
+    int first = _job->filename_in_count;
+
+    add_source(_job, copy_filename(_path, NULL));
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    char* pattern = copy_filename(_path, "*");
+    HANDLE search = FindFirstFileA(pattern, &entry);
+    free(pattern);
+    if (search == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "ERROR:%s: unable to read directory\n", _path);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
+    do {
+        if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && is_image_filename(entry.cFileName)) {
+            add_filename(_job, copy_filename(_path, entry.cFileName));
+        }
+    } while (FindNextFileA(search, &entry));
+    FindClose(search);
+#else
+    struct dirent* entry;
+    DIR* directory = opendir(_path);
+    if (directory == NULL) {
+        fprintf(stderr, "ERROR:%s: unable to read directory\n", _path);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (is_image_filename(entry->d_name)) {
+            char* filename = copy_filename(_path, entry->d_name);
+            if (is_directory(filename)) {
+                free(filename);
+            } else {
+                add_filename(_job, filename);
+            }
+        }
+    }
+    closedir(directory);
+#endif
+
+    qsort(&_job->filename_in[first], _job->filename_in_count - first, sizeof(char*), compare_filenames);
+
+}
+
+// This function adds the files matching a pattern (with '*' and '?' 
+// wildcards), sorted by name.
+
+void add_filenames_from_pattern(Job* _job, char* _pattern, int _argc, char* _argv[]) {
+
+    int first = _job->filename_in_count;
+
+#ifdef _WIN32
+    // FindFirstFile returns only the names of the files, so the directory
+    // part of the pattern is kept to build the complete paths.
+    WIN32_FIND_DATAA entry;
+    char* directory = copy_filename(_pattern, NULL);
+    HANDLE search = FindFirstFileA(_pattern, &entry);
+    if (search != INVALID_HANDLE_VALUE) {
+        basename(directory)[0] = 0;
+        do {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                char* filename = malloc(strlen(directory) + strlen(entry.cFileName) + 1);
+                strcpy(filename, directory);
+                strcat(filename, entry.cFileName);
+                add_filename(_job, filename);
+            }
+        } while (FindNextFileA(search, &entry));
+        FindClose(search);
+    }
+    free(directory);
+#else
+    glob_t matches;
+    size_t i;
+    if (glob(_pattern, 0, NULL, &matches) == 0) {
+        for (i = 0; i < matches.gl_pathc; ++i) {
+            if (!is_directory(matches.gl_pathv[i])) {
+                add_filename(_job, copy_filename(matches.gl_pathv[i], NULL));
+            }
+        }
+    }
+    globfree(&matches);
+#endif
+
+    if (first == _job->filename_in_count) {
+        fprintf(stderr, "ERROR:%s: no file matches the pattern\n", _pattern);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
+
+    qsort(&_job->filename_in[first], _job->filename_in_count - first, sizeof(char*), compare_filenames);
+
+}
+
+void add_input(Job* _job, char* _input, int _argc, char* _argv[]);
+
+// This function adds the inputs listed into a file, one for each line. 
+// Empty lines and lines starting with '#' are ignored.
+
+void add_inputs_from_list(Job* _job, char* _filename, int _argc, char* _argv[]) {
+
+    char line[1024];
+    size_t length;
+    FILE* handle = fopen(_filename, "rt");
+
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR:%s: unable to open file\n", _filename);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
+
+    add_source(_job, copy_filename(_filename, NULL));
+
+    while (fgets(line, sizeof(line), handle) != NULL) {
+        length = strlen(line);
+        while (length > 0 && isspace((unsigned char)line[length - 1])) {
+            line[--length] = 0;
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        add_input(_job, line, _argc, _argv);
+    }
+
+    fclose(handle);
+
+}
+
+// This function adds the images given by an input: a single file, all the
+// images of a directory, the files matching a pattern or (if the input 
+// starts with '@') the inputs listed into a file.
+
+void add_input(Job* _job, char* _input, int _argc, char* _argv[]) {
+
+    if (_input[0] == '@') {
+        add_inputs_from_list(_job, _input + 1, _argc, _argv);
+    } else if (strpbrk(_input, "*?") != NULL) {
+        add_filenames_from_pattern(_job, _input, _argc, _argv);
+    } else if (is_directory(_input)) {
+        add_filenames_from_directory(_job, _input, _argc, _argv);
+    } else {
+        add_filename(_job, copy_filename(_input, NULL));
+    }
+
+}
+
+// This function checks that an option is given where it can be (see 
+// OPTIONS_COMMAND_LINE): _allowed is the last place where it can be given.
+
+void check_option_origin(int _origin, int _allowed, int _index, int _argc, char* _argv[]) {
+
+    if (_origin <= _allowed) {
+        return;
+    }
+
+    if (_origin == OPTIONS_MANIFEST) {
+        fprintf(stderr, "ERROR:: option '%s' cannot be given for a single job.\n", _argv[_index]);
+    } else {
+        fprintf(stderr, "ERROR:: option '%s' cannot be given to the server.\n", _argv[_index]);
+    }
+    usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+
+}
+
+// This function allows to parse the options entered on the command line 
+// (or on a line of the manifest, or by a request) for the given job. 
+// Options must start with a minus character ('-') and only the first letter
+// is considered, except for long options (starting with '--'). Arguments 
+// starting with '@' are files with a list of inputs. Long options are 
+// options of the whole execution: so, they cannot be given on a line of 
+// the manifest (see OPTIONS_COMMAND_LINE).
+
+void parse_options(int _argc, char* _argv[], Job* _job, int _origin) {
+
+    // Used as index.
+    int i, j, c;
+
+    // We check for each option...
+    for (i = 1; i < _argc; ++i) {
+
+        // A list of inputs can be given as '@<filename>'
+        if (_argv[i][0] == '@') {
+            add_input(_job, _argv[i], _argc, _argv);
+        }
+
+        // Parse it only if begins with '-'
+        if (_argv[i][0] == '-') {
+
+            switch (_argv[i][1]) {
+                case 'i': // "-i <filename>"
+                    add_input(_job, _argv[i + 1], _argc, _argv);
+                    ++i;
+                    break;
+                case 'o': // "-o <filename>"
+                    free(_job->filename_out);
+                    _job->filename_out = copy_filename(_argv[i + 1], NULL);
+                    ++i;
+                    break;
+                case 'l': // "-l <luminance>"
+                    _job->configuration.luminance_threshold = atoi(_argv[i + 1]);
+                    ++i;
+                    break;
+                case 'b': // "-b <number>"
+                    _job->configuration.bank = atoi(_argv[i + 1]);
+                    ++i;
+                    break;
+                case 'B': // "-B <color>"
+                    c = sizeof(COLORS) / sizeof(NamedRGB);
+                    for (j = 0; j < c; ++j) {
+                        if (stricmp(_argv[i + 1], COLORS[j].name) == 0) {
+                            _job->configuration.background = j;
+                            break;
+                        }
+                    }
+                    if (j == c) {
+                        printf("Unknown color: %s", _argv[i+1]);
+                        usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+                    }
+                    ++i;
+                    break;
+                case 'R': // "-R"
+                    _job->configuration.reverse = 1;
+                    break;
+                case 'v': // "-v"
+                    verbose = 1;
+                    break;
+                case 'q': // "-q"
+                    verbose = 0;
+                    break;
+                case 'd': // "-d"
+                    debug = 1;
+                    break;
+                case 'm': // "-m"
+                    _job->configuration.multicolor = 1;
+                    break;
+                case 'u': // "-u"
+                    _job->deduplicate = DEDUPLICATE_EXACT;
+                    break;
+                case 'U': // "-U"
+                    _job->deduplicate = DEDUPLICATE_FLIPS;
+                    break;
+                case 'M': // "-M <filename>"
+                    free(_job->filename_depend);
+                    _job->filename_depend = copy_filename(_argv[i + 1], NULL);
+                    ++i;
+                    break;
+                case 'g': // "-g"
+                    free(_job->filename_header);
+                    _job->filename_header = copy_filename(_argv[i + 1], NULL);
+                    ++i;
+                    break;
+                case 'j': // "-j <number>"
+                    jobs = atoi(_argv[i + 1]);
+                    ++i;
+                    break;
+                case 'p': // "-p <pixels>"
+                    parallel_pixels = atoi(_argv[i + 1]);
+                    ++i;
+                    break;
+                case '-': // long options
+                    if (strcmp(_argv[i], "--jobs") == 0) { // "--jobs <manifest>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        filename_manifest = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--serve") == 0) { // "--serve <socket>"
+                        check_option_origin(_origin, OPTIONS_COMMAND_LINE, i, _argc, _argv);
+                        filename_socket = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--cache-dir") == 0) { // "--cache-dir <directory>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        cache_directory = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--cache") == 0) { // "--cache <megabytes>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        decode_cache_limit = atoll(_argv[i + 1]) * 1048576;
+                        ++i;
+                    } else if (strcmp(_argv[i], "--preview-width") == 0) { // "--preview-width <columns>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        preview_columns = atoi(_argv[i + 1]);
+                        ++i;
+                    } else if (strcmp(_argv[i], "--stream") == 0) { // "--stream <megabytes>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        stream_bytes = atoll(_argv[i + 1]) * 1048576;
+                        ++i;
+                    } else if (strcmp(_argv[i], "--benchmark") == 0) { // "--benchmark"
+                        check_option_origin(_origin, OPTIONS_COMMAND_LINE, i, _argc, _argv);
+                        benchmark = 1;
+                    } else if (strcmp(_argv[i], "--benchmark-compare") == 0) { // "--benchmark-compare <filename>"
+                        check_option_origin(_origin, OPTIONS_COMMAND_LINE, i, _argc, _argv);
+                        benchmark = 1;
+                        filename_benchmark_baseline = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--corpus") == 0) { // "--corpus <directory>"
+                        check_option_origin(_origin, OPTIONS_COMMAND_LINE, i, _argc, _argv);
+                        directory_corpus = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--golden") == 0) { // "--golden <filename>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        filename_golden = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--trace") == 0) { // "--trace <filename>"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        filename_trace = _argv[i + 1];
+                        ++i;
+                    } else if (strcmp(_argv[i], "--perf-counters") == 0) { // "--perf-counters"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        perf_counters = 1;
+                        if (statistics_format == STATISTICS_NONE) {
+                            statistics_format = STATISTICS_TEXT;
+                        }
+                    } else if (strcmp(_argv[i], "--stats") == 0) { // "--stats"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        statistics_format = STATISTICS_TEXT;
+                    } else if (strcmp(_argv[i], "--stats=json") == 0) { // "--stats=json"
+                        check_option_origin(_origin, OPTIONS_REQUEST, i, _argc, _argv);
+                        statistics_format = STATISTICS_JSON;
+                    } else {
+                        fprintf(stderr, "ERROR:: unknown option '%s'.\n", _argv[i]);
+                        usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+                    }
+                    break;
+                default:
+                    fprintf(stderr, "ERROR:: unknown option '%s'.\n", _argv[i]);
+                    usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+            }
+
+        }
+    }
+
+}
+
+// This function initializes a job with the options of the given one (but
+// without its inputs and outputs), or with the default values if NULL. The
+// given job can be the job itself.
+
+void init_job(Job* _job, Job* _defaults) {
+
+    Configuration job_configuration = _defaults ? _defaults->configuration : configuration;
+    int job_deduplicate = _defaults ? _defaults->deduplicate : DEDUPLICATE_NONE;
+
+    memset(_job, 0, sizeof(Job));
+    _job->configuration = job_configuration;
+    _job->deduplicate = job_deduplicate;
+
+}
+
+// This function adds a job to be executed, with the options of the given 
+// one. The pointer returned is valid until the next job is added.
+
+Job* add_job(Job* _defaults) {
+
+    jobs_list = realloc(jobs_list, sizeof(Job) * (jobs_count + 1));
+    init_job(&jobs_list[jobs_count], _defaults);
+
+    return &jobs_list[jobs_count++];
+
+}
+
+// This function splits a line of the manifest (or a request) into 
+// arguments, separated by spaces (arguments with spaces can be put between
+// double quotes). Each argument is copied, and must be freed with
+// free_arguments. The first argument is the name of the program, as for 
+// the command line.
+
+int split_manifest_line(char* _line, char* _program, char*** _arguments) {
+
+    int count = 1, size = 16;
+    char* argument;
+    char* end;
+
+    *_arguments = malloc(sizeof(char*) * size);
+    (*_arguments)[0] = _program;
+
+    while (*_line) {
+        while (isspace((unsigned char)*_line)) {
+            ++_line;
+        }
+        if (*_line == 0) {
+            break;
+        }
+        if (*_line == '"') {
+            ++_line;
+            end = strchr(_line, '"');
+        } else {
+            end = _line;
+            while (*end && !isspace((unsigned char)*end)) {
+                ++end;
+            }
+        }
+        if (end == NULL) {
+            end = _line + strlen(_line);
+        }
+        argument = malloc(end - _line + 1);
+        memcpy(argument, _line, end - _line);
+        argument[end - _line] = 0;
+        if (count == size) {
+            size *= 2;
+            *_arguments = realloc(*_arguments, sizeof(char*) * size);
+        }
+        (*_arguments)[count++] = argument;
+        _line = *end ? end + 1 : end;
+    }
+
+    return count;
+
+}
+
+// This function frees the arguments of a line of the manifest (or a 
+// request), except the name of the program.
+
+void free_arguments(int _count, char** _arguments) {
+
+    int i;
+
+    for (i = 1; i < _count; ++i) {
+        free(_arguments[i]);
+    }
+    free(_arguments);
+
+}
+
+// This function reads the manifest: each line describes a job, with the 
+// same options of the command line (empty lines and lines starting with 
+// '#' are ignored). The options given on the command line are used as 
+// defaults for each job.
+
+void read_manifest(char* _filename, Job* _defaults, int _argc, char* _argv[]) {
+
+    char line[4096];
+    char** arguments;
+    int count, number = 0;
+    Job* job;
+    char* start;
+    FILE* handle = fopen(_filename, "rt");
+
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR:%s: unable to open file\n", _filename);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
+
+    while (fgets(line, sizeof(line), handle) != NULL) {
+        ++number;
+        start = line;
+        while (isspace((unsigned char)*start)) {
+            ++start;
+        }
+        if (*start == 0 || *start == '#') {
+            continue;
+        }
+        count = split_manifest_line(start, _argv[0], &arguments);
+        job = add_job(_defaults);
+        add_source(job, copy_filename(_filename, NULL));
+        parse_options(count, arguments, job, OPTIONS_MANIFEST);
+        free_arguments(count, arguments);
+        if (job->filename_in_count == 0) {
+            fprintf(stderr, "ERROR:%s:%d: missing input filename.\n", _filename, number);
+            usage_and_exit(ERL_MISSING_INPUT_FILENAME, _argc, _argv);
+        }
+        if (job->filename_out == NULL) {
+            fprintf(stderr, "ERROR:%s:%d: missing output filename.\n", _filename, number);
+            usage_and_exit(ERL_MISSING_OUTPUT_FILENAME, _argc, _argv);
+        }
+    }
+
+    fclose(handle);
+
+}
+
+// This function returns the number of processors available.
+
+int count_processors() {
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+
+}
+
+// This function returns the time (in seconds) of a monotonic clock: it is
+// used only to measure how long something takes.
+
+double get_monotonic_time() {
+
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+
+}
+
+// This function adds a value to a counter shared between threads.
+
+void atomic_add(volatile long long* _counter, long long _value) {
+#ifdef _WIN32
+    InterlockedExchangeAdd64(_counter, _value);
+#else
+    __sync_fetch_and_add(_counter, _value);
+#endif
+}
+
+// This function opens the performance counters of the current thread (see
+// --perf-counters), the first time it is called by the thread: they are a
+// group led by the cycles, so that all the events are counted together. 
+// Events that cannot be counted are ignored, but if cycles cannot be 
+// counted no event is. It returns 0 if no event can be counted.
+
+int open_perf_counters() {
+
+#ifdef IMG2TILE_PERF
+    static const unsigned long long events[PERF_COUNTERS_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr attributes;
+    int i;
+
+    if (thread_perf_state != 0) {
+        return thread_perf_state > 0;
+    }
+
+    thread_perf_state = -1;
+
+    for (i = 0; i < PERF_COUNTERS_COUNT; ++i) {
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = events[i];
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        thread_perf_counters[i] = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, i == 0 ? -1 : thread_perf_counters[0], 0);
+        if (thread_perf_counters[i] >= 0) {
+            perf_available[i] = 1;
+        } else if (i == 0) {
+            perf_error = errno;
+            return 0;
+        }
+    }
+
+    thread_perf_state = 1;
+
+    return 1;
+#else
+    return 0;
+#endif
+
+}
+
+// This function closes the performance counters of the current thread.
+
+void close_perf_counters() {
+
+#ifdef IMG2TILE_PERF
+    int i;
+
+    if (thread_perf_state > 0) {
+        for (i = 0; i < PERF_COUNTERS_COUNT; ++i) {
+            if (thread_perf_counters[i] >= 0) {
+                close(thread_perf_counters[i]);
+            }
+        }
+    }
+
+    thread_perf_state = 0;
+#endif
+
+}
+
+// This function reads the events counted by the current thread so far (0 
+// if they cannot be counted). If the counters have not been running all 
+// the time (when the processor has not enough of them), the events are 
+// estimated for the whole time.
+
+void read_perf_counters(long long _values[]) {
+
+    int i;
+#ifdef IMG2TILE_PERF
+    unsigned long long data[3 + PERF_COUNTERS_COUNT];
+    double scale;
+    int j;
+#endif
+
+    for (i = 0; i < PERF_COUNTERS_COUNT; ++i) {
+        _values[i] = 0;
+    }
+
+#ifdef IMG2TILE_PERF
+    if (!open_perf_counters() || read(thread_perf_counters[0], data, sizeof(data)) < (ssize_t)(3 * sizeof(unsigned long long))) {
+        return;
+    }
+
+    // Number of events, time enabled and time running, then the events.
+    scale = data[2] > 0 ? (double)data[1] / data[2] : 1;
+    for (i = 0, j = 0; i < PERF_COUNTERS_COUNT && j < (int)data[0]; ++i) {
+        if (thread_perf_counters[i] >= 0) {
+            _values[i] = (long long)(data[3 + j++] * scale);
+        }
+    }
+#endif
+
+}
+
+// This function starts a phase (see --stats): it returns the current time
+// and, if needed, it reads the events counted by the current thread.
+
+double start_phase() {
+
+    if (perf_counters) {
+        read_perf_counters(thread_perf_start);
+    }
+
+    return get_monotonic_time();
+
+}
+
+// This function adds the time elapsed since the given one to a phase (see 
+// --stats), as well as the events counted by the current thread since the
+// phase started (see --perf-counters), and returns the current time (the
+// start of the next phase).
+
+double add_phase_time(double* _time, int _phase, double _start) {
+
+    double now = get_monotonic_time();
+    long long values[PERF_COUNTERS_COUNT];
+    int i;
+
+    *_time += now - _start;
+
+    if (perf_counters) {
+        read_perf_counters(values);
+        for (i = 0; i < PERF_COUNTERS_COUNT; ++i) {
+            atomic_add(&perf_events[_phase][i], values[i] - thread_perf_start[i]);
+            thread_perf_start[i] = values[i];
+        }
+    }
+
+    return now;
+
+}
+
+// This function returns the largest memory (in kilobytes) taken by the 
+// process since it started (0 if unknown).
+
+long long get_peak_memory() {
+
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return (long long)counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (long long)usage.ru_maxrss / 1024;
+#else
+    return (long long)usage.ru_maxrss;
+#endif
+#endif
+
+}
+
+// These functions initialize, lock, unlock and destroy a mutex.
+
+void mutex_init(Mutex* _mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(_mutex);
+#else
+    pthread_mutex_init(_mutex, NULL);
+#endif
+}
+
+void mutex_lock(Mutex* _mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(_mutex);
+#else
+    pthread_mutex_lock(_mutex);
+#endif
+}
+
+void mutex_unlock(Mutex* _mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(_mutex);
+#else
+    pthread_mutex_unlock(_mutex);
+#endif
+}
+
+void mutex_destroy(Mutex* _mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(_mutex);
+#else
+    pthread_mutex_destroy(_mutex);
+#endif
+}
+
+// This function increments a counter shared between threads, and returns 
+// the value before the increment.
+
+long atomic_fetch_increment(volatile long* _counter) {
+#ifdef _WIN32
+    return InterlockedIncrement(_counter) - 1;
+#else
+    return __sync_fetch_and_add(_counter, 1);
+#endif
+}
+
+// This function replaces a pointer shared between threads with the given 
+// value, only if it is still the expected one. It returns 1 if replaced.
+
+int atomic_compare_exchange_pointer(void* volatile* _target, void* _expected, void* _value) {
+#ifdef _WIN32
+    return InterlockedCompareExchangePointer(_target, _value, _expected) == _expected;
+#else
+    return __sync_bool_compare_and_swap(_target, _expected, _value);
+#endif
+}
+
+// This function returns when a span of the trace starts (see --trace), or 
+// 0 if the execution is not traced.
+
+double start_trace_span() {
+
+    return filename_trace != NULL ? get_monotonic_time() : 0;
+
+}
+
+// This function records a span of the trace (see --trace), from the given
+// start to now, into the buffer of the current thread. The buffer is added
+// to the list of buffers the first time the thread records a span of the
+// trace: the list is changed without locks, as well.
+
+void end_trace_span(const char* _name, char* _filename, double _start) {
+
+    TraceBuffer* buffer = thread_trace_buffer;
+    TraceEvent* event;
+
+    if (filename_trace == NULL) {
+        return;
+    }
+
+    if (buffer == NULL || thread_trace_generation != trace_generation) {
+        buffer = malloc(sizeof(TraceBuffer));
+        buffer->thread = (int)atomic_fetch_increment(&trace_threads);
+        buffer->events = NULL;
+        buffer->count = 0;
+        buffer->size = 0;
+        do {
+            buffer->next = trace_buffers;
+        } while (!atomic_compare_exchange_pointer((void* volatile*)&trace_buffers, buffer->next, buffer));
+        thread_trace_buffer = buffer;
+        thread_trace_generation = trace_generation;
+    }
+
+    if (buffer->count == buffer->size) {
+        buffer->size = buffer->size ? buffer->size * 2 : 256;
+        buffer->events = realloc(buffer->events, sizeof(TraceEvent) * buffer->size);
+    }
+
+    event = &buffer->events[buffer->count++];
+    event->name = _name;
+    event->filename = _filename;
+    event->start = _start - trace_start;
+    event->duration = get_monotonic_time() - _start;
+
+}
+
+// This function frees the spans recorded by all the threads.
+
+void free_trace() {
+
+    TraceBuffer* buffer;
+
+    while ((buffer = trace_buffers) != NULL) {
+        trace_buffers = buffer->next;
+        free(buffer->events);
+        free(buffer);
+    }
+
+}
+
+// This function starts the trace of the execution (see --trace), 
+// forgetting the spans of the previous one (if abandoned).
+
+void start_trace() {
+
+    free_trace();
+
+    ++trace_generation;
+    trace_threads = 0;
+    trace_start = get_monotonic_time();
+
+}
+
+// This is the body of each thread used by run_in_parallel: it takes the 
+// next task not yet taken by any other thread, until there are no more.
+
+THREAD_FUNCTION(parallel_worker) {
+
+    ParallelWork* work = (ParallelWork*)_argument;
+    long i;
+
+    while ((i = atomic_fetch_increment(&work->next)) < work->count) {
+        work->task(work->order != NULL ? work->order[i] : (int)i, work->context);
+    }
+
+    return 0;
+
+}
+
+// This is the body of each thread started by run_in_parallel: it works as
+// the calling thread does, and then frees the resources of the thread.
+
+THREAD_FUNCTION(parallel_thread) {
+
+    parallel_worker(_argument);
+
+    close_perf_counters();
+
+    return 0;
+
+}
+
+// This function runs _count tasks using up to _threads threads (the calling
+// one included), and returns when all of them are done. Tasks are taken in 
+// the given order (if any) by the first idle thread, so that a thread that 
+// received a quick task goes on with the next one.
+
+void run_in_parallel(int _threads, int _count, int* _order, ParallelTask _task, void* _context) {
+
+    ParallelWork work;
+    Thread* threads;
+    int i, started = 0;
+
+    work.task = _task;
+    work.context = _context;
+    work.order = _order;
+    work.count = _count;
+    work.next = 0;
+
+    if (_threads > _count) {
+        _threads = _count;
+    }
+
+    threads = malloc(sizeof(Thread) * (_threads > 1 ? _threads - 1 : 1));
+
+    // If a thread cannot be started, its tasks will be done by the others.
+    for (i = 0; i < _threads - 1; ++i) {
+#ifdef _WIN32
+        threads[started] = (HANDLE)_beginthreadex(NULL, 0, parallel_thread, &work, 0, NULL);
+        if (threads[started] != 0) {
+            ++started;
+        }
+#else
+        if (pthread_create(&threads[started], NULL, parallel_thread, &work) == 0) {
+            ++started;
+        }
+#endif
+    }
+
+    parallel_worker(&work);
+
+    for (i = 0; i < started; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    free(threads);
+
+}
+
+// This function calculates the luminance of a color. 
+// By luminance we mean the modulus of the three-dimensional vector, drawn 
+// in the space composed of the three components (red, green and blue).
+// The returned value is normalized to the nearest 8-bit value.
+
+int calculate_luminance(RGB _a) {
+
+    // Extract the vector's components 
+    // (each partecipate up to 1/3 of the luminance).
+    double red = (double)_a.red / 3;
+    double green = (double)_a.green / 3;
+    double blue = (double)_a.blue / 3;
+
+    // Calculate luminance using Pitagora's Theorem
+    return (int)sqrt(pow(red, 2) + pow(green, 2) + pow(blue, 2));
+
+}
+
+// This function calculates the color distance between two colors(_a and _b).
+// By "distance" we mean the geometric distance between two points in a 
+// three-dimensional space, where each dimension corresponds to one of the 
+// components (red, green and blue). The returned value is normalized to 
+// the nearest 8-bit value.
+
+int calculate_distance(RGB _a, RGB _b) {
+
+    // Extract the vector's components.
+    double red = (double)_a.red - (double)_b.red;
+    double green = (double)_a.green - (double)_b.green;
+    double blue = (double)_a.blue - (double)_b.blue;
+
+    // Calculate distance using Pitagora's Theorem
+    return (int)sqrt(pow(red, 2) + pow(green, 2) + pow(blue, 2));
+
+}
+
+// This function detects the best instruction set available for the 
+// conversion kernels on the running processor.
+
+int detect_simd_level() {
+
+#ifdef IMG2TILE_X86
+    #ifdef _MSC_VER
+        int info[4];
+        int max_leaf;
+
+        __cpuid(info, 0);
+        max_leaf = info[0];
+
+        __cpuid(info, 1);
+        if ((info[3] & (1 << 26)) == 0) {
+            return SIMD_NONE;
+        }
+
+        // AVX2 needs also the support of the operating system (OSXSAVE and AVX
+        // state enabled in XCR0).
+        if (max_leaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6)) {
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5)) {
+                return SIMD_AVX2;
+            }
+        }
+        return SIMD_SSE2;
+    #else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SIMD_AVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return SIMD_SSE2;
+        }
+    #endif
+#endif
+
+    return SIMD_NONE;
+
+}
+
+// This function prepares the luminance threshold for the conversion kernels.
+// Since luminance is calculated as sqrt((r/3)^2+(g/3)^2+(b/3)^2), a pixel 
+// has a luminance of at least T if r^2+g^2+b^2 >= 9*T^2. Luminance never 
+// exceeds 147, so greater thresholds can be clamped without overflows.
+// Luminance planes are compared with the threshold itself, while grey 
+// pixels (as if their three components were the same grey) are compared 
+// with the lowest grey whose luminance reaches the threshold (256 if none).
+
+void prepare_luminance_threshold(Configuration* _configuration, LuminanceThreshold* _threshold) {
+
+    int threshold = _configuration->luminance_threshold;
+    int level = 0;
+    RGB grey;
+
+    if (threshold < 0) {
+        threshold = 0;
+    } else if (threshold > 148) {
+        threshold = 148;
+    }
+
+    _threshold->threshold = _configuration->luminance_threshold;
+    _threshold->square_threshold = 9 * threshold * threshold;
+    if (_configuration->luminance) {
+        _threshold->level = threshold;
+    } else {
+        for (; level < 256; ++level) {
+            grey.red = grey.green = grey.blue = level;
+            if (calculate_luminance(grey) >= _configuration->luminance_threshold) {
+                break;
+            }
+        }
+        _threshold->level = level;
+    }
+    _threshold->reverse_mask = _configuration->reverse ? 0xff : 0x00;
+    _threshold->bgr = _configuration->bgr;
+
+}
+
+// This function decides if a pixel, whose sum of squares is exactly equal to
+// the square threshold, is "on". In this (rare) case the outcome depends on
+// how calculate_luminance rounds the square root, so it is used directly
+// (with the components in the right order).
+
+int is_luminance_tie_on(unsigned char* _source, LuminanceThreshold* _threshold) {
+
+    RGB rgb;
+
+    rgb.red = *(_source + (_threshold->bgr ? 2 : 0));
+    rgb.green = *(_source + 1);
+    rgb.blue = *(_source + (_threshold->bgr ? 0 : 2));
+
+    return calculate_luminance(rgb) >= _threshold->threshold;
+
+}
+
+// This function calculates the luminance of a pixel, as calculate_luminance
+// does. A square root in single precision gives the same luminance, unless
+// 9 times the square of the luminance (or of the next one) is r^2+g^2+b^2 
+// (then it depends on how the square root is rounded, and the function is
+// used directly).
+
+int calculate_pixel_luminance(unsigned char* _source) {
+
+    int square = _source[0] * _source[0] + _source[1] * _source[1] + _source[2] * _source[2];
+    int luminance = (int)(sqrtf((float)square) * (1.0f / 3));
+    RGB rgb;
+
+    if (9 * luminance * luminance == square || 9 * (luminance + 1) * (luminance + 1) == square) {
+        rgb.red = _source[0];
+        rgb.green = _source[1];
+        rgb.blue = _source[2];
+        luminance = calculate_luminance(rgb);
+    }
+
+    return luminance;
+
+}
+
+// This function converts 8 pixels into a mixel (one row of a tile), 
+// without using any SIMD instruction.
+
+mr_mixel convert_pixels_into_mixel(unsigned char* _source, int _depth, LuminanceThreshold* _threshold) {
+
+    int i, square, bits = 0;
+
+    for (i = 0; i < 8; ++i) {
+        square = _source[0] * _source[0] + _source[1] * _source[1] + _source[2] * _source[2];
+        if (square > _threshold->square_threshold || 
+            (square == _threshold->square_threshold && is_luminance_tie_on(_source, _threshold))) {
+            bits |= 0x80 >> i;
+        }
+        _source += _depth;
+    }
+
+    return (mr_mixel)(bits ^ _threshold->reverse_mask);
+
+}
+
+// This function converts a band of 8 rows of pixels into a row of tiles,
+// without using any SIMD instruction. Tiles are converted one at a time, 
+// so that the 8 mixels of each tile are written contiguously.
+
+void convert_band_into_tiles_scalar(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    int i;
+
+    for (; _count > 0; --_count) {
+        for (i = 0; i < 8; ++i) {
+            _destination[i] = convert_pixels_into_mixel(_source + i * _row_size, _depth, _threshold);
+        }
+        _source += 8 * _depth;
+        _destination += 8;
+    }
+
+}
+
+// This function converts a band of 8 rows of pixels with the luminance (or
+// the grey) in the first byte into a row of tiles, without using any SIMD
+// instruction.
+
+void convert_luminance_band_into_tiles_scalar(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    unsigned char* source;
+    int i, j, bits;
+
+    for (; _count > 0; --_count) {
+        for (i = 0; i < 8; ++i) {
+            source = _source + i * _row_size;
+            for (bits = 0, j = 0; j < 8; ++j) {
+                if (source[j * _depth] >= _threshold->level) {
+                    bits |= 0x80 >> j;
+                }
+            }
+            _destination[i] = (mr_mixel)(bits ^ _threshold->reverse_mask);
+        }
+        _source += 8 * _depth;
+        _destination += 8;
+    }
+
+}
+
+#ifdef IMG2TILE_X86
+
+// This function converts a band of 8 rows of a luminance plane (or of grey
+// pixels) into a row of tiles, using SSE2 instructions: two rows of a tile 
+// (8 bytes each) are compared with the level at once. Since the kernel 
+// reads only the pixels of the tile, no tile is left to the scalar kernel.
+
+TARGET_SSE2 void convert_luminance_band_into_tiles_sse2(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    __m128i level, rows;
+    uint64_t tile;
+    int i, bits;
+
+    // A level of 256 (all "off") cannot be compared as a byte.
+    if (_threshold->level > 255) {
+        convert_luminance_band_into_tiles_scalar(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+        return;
+    }
+
+    level = _mm_set1_epi8((char)_threshold->level);
+
+    for (; _count > 0; --_count) {
+        tile = 0;
+        for (i = 0; i < 8; i += 2) {
+            rows = _mm_unpacklo_epi64(
+                _mm_loadl_epi64((__m128i*)(_source + i * _row_size)),
+                _mm_loadl_epi64((__m128i*)(_source + (i + 1) * _row_size)));
+            bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(rows, level), rows));
+            tile |= (uint64_t)(REVERSE_BITS[bits & 0xff] ^ _threshold->reverse_mask) << (i * 8);
+            tile |= (uint64_t)(REVERSE_BITS[bits >> 8] ^ _threshold->reverse_mask) << (i * 8 + 8);
+        }
+        memcpy(_destination, &tile, 8);
+        _source += 8;
+        _destination += 8;
+    }
+
+}
+
+// This function resolves the pixels (given as a bitmask) whose sum of squares
+// is exactly equal to the square threshold. It returns the bitmask of those
+// that are "on", with the leftmost pixel in the least significant bit.
+
+int resolve_luminance_ties(unsigned char* _source, int _depth, int _ties, LuminanceThreshold* _threshold) {
+
+    int i, bits = 0;
+
+    for (i = 0; i < 8; ++i) {
+        if ((_ties & (1 << i)) && is_luminance_tie_on(_source + i * _depth, _threshold)) {
+            bits |= 1 << i;
+        }
+    }
+
+    return bits;
+
+}
+
+// This function loads 4 pixels (with 3 or 4 bytes each) in the 32-bit lanes
+// of a vector, as (red, green, blue, 0).
+
+TARGET_SSE2 static __m128i load_pixels_sse2(unsigned char* _source, int _depth) {
+
+    __m128i pixels;
+    int lanes[4];
+
+    if (_depth == 4) {
+        pixels = _mm_loadu_si128((__m128i*)_source);
+    } else {
+        memcpy(&lanes[0], _source, 4);
+        memcpy(&lanes[1], _source + 3, 4);
+        memcpy(&lanes[2], _source + 6, 4);
+        memcpy(&lanes[3], _source + 9, 4);
+        pixels = _mm_loadu_si128((__m128i*)lanes);
+    }
+
+    return _mm_and_si128(pixels, _mm_set1_epi32(0x00ffffff));
+
+}
+
+// This function calculates the sum of the squares of the components of the
+// 4 pixels loaded by load_pixels_sse2.
+
+TARGET_SSE2 static __m128i sum_of_squares_sse2(__m128i _pixels) {
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_unpacklo_epi8(_pixels, zero);
+    __m128i high = _mm_unpackhi_epi8(_pixels, zero);
+
+    // (r^2+g^2, b^2) for each pixel
+    low = _mm_madd_epi16(low, low);
+    high = _mm_madd_epi16(high, high);
+
+    return _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1)))
+    );
+
+}
+
+// This function calculates the luminance of the pixels, 4 at a time, as 
+// calculate_pixel_luminance does (the square root is the same), using SSE2
+// instructions. Pixels can be converted in place, since each luminance is
+// written after the pixels are read. Since the kernel reads a byte after 
+// the 4 pixels, the last one is left to the caller: it returns how many 
+// pixels are converted.
+
+TARGET_SSE2 long long convert_pixels_into_luminance_sse2(unsigned char* _source, int _depth, long long _count, unsigned char* _destination) {
+
+    __m128 third = _mm_set1_ps(1.0f / 3), nine = _mm_set1_ps(9.0f), one = _mm_set1_ps(1.0f);
+    __m128 squares, luminance, next;
+    __m128i values;
+    unsigned char bytes[4];
+    long long i;
+    int j, ties, lanes;
+
+    for (i = 0; i + 5 <= _count; i += 4) {
+        squares = _mm_cvtepi32_ps(sum_of_squares_sse2(load_pixels_sse2(_source, _depth)));
+        luminance = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_sqrt_ps(squares), third)));
+        next = _mm_add_ps(luminance, one);
+        ties = _mm_movemask_ps(_mm_or_ps(
+            _mm_cmpeq_ps(_mm_mul_ps(_mm_mul_ps(luminance, luminance), nine), squares),
+            _mm_cmpeq_ps(_mm_mul_ps(_mm_mul_ps(next, next), nine), squares)));
+        values = _mm_cvttps_epi32(luminance);
+        values = _mm_packs_epi32(values, values);
+        lanes = _mm_cvtsi128_si32(_mm_packus_epi16(values, values));
+        memcpy(bytes, &lanes, 4);
+        for (j = 0; ties != 0; ++j, ties >>= 1) {
+            if (ties & 1) {
+                bytes[j] = (unsigned char)calculate_pixel_luminance(_source + j * _depth);
+            }
+        }
+        memcpy(_destination, bytes, 4);
+        _source += 4 * _depth;
+        _destination += 4;
+    }
+
+    return i;
+
+}
+
+// This function converts a band of 8 rows of pixels into a row of tiles,
+// using SSE2 instructions (4 pixels for each vector). The 8 mixels of each 
+// tile are assembled into a 64-bit word and written at once (x86 is little
+// endian, so the first row goes into the lowest byte). Since the kernel 
+// reads up to 32 bytes for each row, the last tiles of the image are left 
+// to the scalar kernel. Rows can go backwards (negative _row_size), so the
+// row with the highest address is the first or the last one.
+
+TARGET_SSE2 void convert_band_into_tiles_sse2(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    __m128i square_threshold = _mm_set1_epi32(_threshold->square_threshold);
+    __m128i left, right;
+    unsigned char* source;
+    uint64_t tile;
+    int i, bits, ties;
+    int highest_row = _row_size > 0 ? 7 * _row_size : 0;
+
+    for (; _count > 0 && _source + highest_row + 32 <= _end; --_count) {
+        tile = 0;
+        for (i = 0, source = _source; i < 8; ++i, source += _row_size) {
+            left = sum_of_squares_sse2(load_pixels_sse2(source, _depth));
+            right = sum_of_squares_sse2(load_pixels_sse2(source + 4 * _depth, _depth));
+            bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(left, square_threshold))) |
+                (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(right, square_threshold))) << 4);
+            ties = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(left, square_threshold))) |
+                (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(right, square_threshold))) << 4);
+            if (ties) {
+                bits |= resolve_luminance_ties(source, _depth, ties, _threshold);
+            }
+            tile |= (uint64_t)(REVERSE_BITS[bits] ^ _threshold->reverse_mask) << (i * 8);
+        }
+        memcpy(_destination, &tile, 8);
+        _source += 8 * _depth;
+        _destination += 8;
+    }
+
+    convert_band_into_tiles_scalar(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+
+}
+
+// This function converts a band of 8 rows of pixels into a row of tiles,
+// using AVX2 instructions (8 pixels for each vector). The components are
+// spread into 16-bit words by a shuffle, so that a multiply-add gives the
+// sum of the squares.
+
+TARGET_AVX2 void convert_band_into_tiles_avx2(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    __m256i square_threshold = _mm256_set1_epi32(_threshold->square_threshold);
+    __m256i red_green_mask, blue_mask, pixels, red_green, blue, squares;
+    unsigned char* source;
+    uint64_t tile;
+    int i, bits, ties;
+    int highest_row = _row_size > 0 ? 7 * _row_size : 0;
+
+    if (_depth == 4) {
+        red_green_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1));
+        blue_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1));
+    } else {
+        red_green_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1));
+        blue_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1));
+    }
+
+    for (; _count > 0 && _source + highest_row + 32 <= _end; --_count) {
+        tile = 0;
+        for (i = 0, source = _source; i < 8; ++i, source += _row_size) {
+            pixels = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((__m128i*)source)),
+                _mm_loadu_si128((__m128i*)(source + 4 * _depth)), 1);
+            red_green = _mm256_shuffle_epi8(pixels, red_green_mask);
+            blue = _mm256_shuffle_epi8(pixels, blue_mask);
+            squares = _mm256_add_epi32(_mm256_madd_epi16(red_green, red_green), _mm256_madd_epi16(blue, blue));
+            bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(squares, square_threshold)));
+            ties = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(squares, square_threshold)));
+            if (ties) {
+                bits |= resolve_luminance_ties(source, _depth, ties, _threshold);
+            }
+            tile |= (uint64_t)(REVERSE_BITS[bits] ^ _threshold->reverse_mask) << (i * 8);
+        }
+        memcpy(_destination, &tile, 8);
+        _source += 8 * _depth;
+        _destination += 8;
+    }
+
+    convert_band_into_tiles_scalar(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+
+}
+
+#endif
+
+// This function converts a band of 8 rows of pixels into a row of tiles,
+// using the best kernel available. Pixels with less than three bytes are
+// luminance planes (or grey pixels, with or without alpha): SIMD kernels 
+// handle them only with a byte for each pixel.
+
+void convert_band_into_tiles(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, LuminanceThreshold* _threshold, mr_mixel* _destination) {
+
+    if (_depth < 3) {
+#ifdef IMG2TILE_X86
+        if (_depth == 1 && simd_level != SIMD_NONE) {
+            convert_luminance_band_into_tiles_sse2(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+            return;
+        }
+#endif
+        convert_luminance_band_into_tiles_scalar(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+        return;
+    }
+
+#ifdef IMG2TILE_X86
+    if (_depth == 3 || _depth == 4) {
+        switch (simd_level) {
+            case SIMD_AVX2:
+                convert_band_into_tiles_avx2(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+                return;
+            case SIMD_SSE2:
+                convert_band_into_tiles_sse2(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+                return;
+        }
+    }
+#endif
+
+    convert_band_into_tiles_scalar(_source, _end, _row_size, _depth, _count, _threshold, _destination);
+
+}
+
+// This function returns how many threads can be used to convert the rows
+// of tiles of an image: only images with more than parallel_pixels pixels
+// are split between threads.
+
+int count_band_threads(Configuration* _configuration) {
+
+    if ((double)_configuration->width * _configuration->height <= parallel_pixels) {
+        return 1;
+    }
+
+    return band_jobs;
+
+}
+
+// This function converts the row of tiles _index of an image. Since each 
+// row of tiles is written into its own tiles, many rows can be converted
+// at the same time.
+
+void convert_band_task(int _index, void* _context) {
+
+    ImageBands* bands = (ImageBands*)_context;
+
+    convert_band_into_tiles(bands->source + _index * 8 * bands->row_size, bands->end, bands->row_size, bands->depth, bands->width_tiles, bands->threshold, bands->tiles + _index * 8 * bands->width_tiles);
+
+}
+
+// This function prints an ASCII representation of the converted tiles of an
+// image, rebuilt from the tiles themselves: a character for each pixel, 
+// that is "*" for "on" pixels or the color index for multicolor tiles. If
+// the image is wider than preview_columns, a character is given for each 
+// block of pixels (its first one), so that each line fits. Each line is 
+// built into a buffer and written at once.
+
+void print_tiles_preview(Configuration* _configuration, mr_mixel* _tiles) {
+
+    int image_x, image_y, length;
+    int step = 1;
+    mr_mixel* tiles;
+    char* line;
+
+    if (preview_columns > 0 && _configuration->width > preview_columns) {
+        step = (_configuration->width + preview_columns - 1) / preview_columns;
+    }
+
+    line = malloc(_configuration->width / step + 2);
+
+    for (image_y = 0; image_y < _configuration->height_tiles * 8; image_y += step) {
+        tiles = _tiles + (image_y >> 3) * 8 * _configuration->width_tiles + (image_y & 0x07);
+        length = 0;
+        for (image_x = 0; image_x < _configuration->width; image_x += step) {
+            if (_configuration->multicolor) {
+                line[length++] = (char)('0' + ((tiles[(image_x >> 2) * 8] >> (6 - ((image_x & 0x3) * 2))) & 0x03));
+            } else if (tiles[(image_x >> 3) * 8] & (0x80 >> (image_x & 0x07))) {
+                line[length++] = '*';
+            } else {
+                line[length++] = ' ';
+            }
+        }
+        line[length++] = '\n';
+        fwrite(line, 1, length, stdout);
+    }
+
+    fwrite("\n\n", 1, 2, stdout);
+
+    free(line);
+
+}
+
+// This function returns the end of the pixels of an image (given by its
+// top row), whose rows can go backwards.
+
+unsigned char* get_pixels_end(unsigned char* _source, Configuration* _configuration) {
+
+    if (_configuration->row_size > 0) {
+        _source += (_configuration->height - 1) * _configuration->row_size;
+    }
+
+    return _source + _configuration->width * _configuration->depth;
+
+}
+
+// This function convert an image of (W,H) pixels in a set of (WT,HT) tiles.
+// Tiles will be drawn in a "contiguous" way, i.e. each row of tiles will
+// be drawn sequentially, and each column for each row the same. The image
+// is converted a tile at a time, reading the 8 rows of pixels of the tile 
+// and writing its 8 mixels contiguously. Tiles are written starting from 
+// _starting_tile, into the (already allocated) output.
+
+void convert_image_into_tiles(unsigned char *_source, Configuration * _configuration, Output * _output, int _starting_tile ) {
+
+    // Luminance threshold, as used by the kernels
+    LuminanceThreshold threshold;
+
+    // Rows of tiles to convert
+    ImageBands bands;
+
+    prepare_luminance_threshold(_configuration, &threshold);
+
+    bands.source = _source;
+    bands.end = get_pixels_end(_source, _configuration);
+    bands.row_size = _configuration->row_size;
+    bands.depth = _configuration->depth;
+    bands.width_tiles = _configuration->width_tiles;
+    bands.threshold = &threshold;
+    bands.palette = NULL;
+    bands.tiles = _output->tiles + ( _starting_tile * 8 );
+
+    // If the pixel has enough luminance value, it must be 
+    // considered as "on"; otherwise, it is "off".
+    run_in_parallel(count_band_threads(_configuration), _configuration->height_tiles, NULL, convert_band_task, &bands);
+
+}
+
+// This function writes to the standard output or, if the current thread 
+// keeps its output into a buffer, to the buffer. Images converted at the 
+// same time keep their output, so that each one is written at once (see 
+// convert_image).
+
+void write_output(const char* _data, size_t _length) {
+
+    OutputBuffer* buffer = thread_output;
+
+    if (buffer == NULL) {
+        fwrite(_data, 1, _length, stdout);
+        return;
+    }
+
+    if (buffer->used + _length > buffer->size) {
+        buffer->size = (buffer->used + _length) * 2 + 4096;
+        buffer->data = realloc(buffer->data, buffer->size);
+    }
+
+    memcpy(buffer->data + buffer->used, _data, _length);
+    buffer->used += _length;
+
+}
+
+// This function writes formatted text as write_output does. Each call 
+// writes up to a line of text.
+
+void print_output(const char* _format, ...) {
+
+    char text[256];
+    va_list arguments;
+
+    va_start(arguments, _format);
+    vsnprintf(text, sizeof(text), _format, arguments);
+    va_end(arguments);
+
+    write_output(text, strlen(text));
+
+}
+
+// This function starts the extraction of the palette of colors of an image
+// (see extract_color_palette), into the given palette.
+
+void start_color_palette(PaletteExtraction* _extraction, Configuration* _configuration, RGB _palette[], int _palette_size) {
+
+    _extraction->configuration = _configuration;
+    _extraction->palette = _palette;
+    _extraction->palette_size = _palette_size;
+    _extraction->count = 0;
+    _extraction->previous = 0;
+
+    // The hash table is kept at most 1/4 full.
+    _extraction->mask = 1;
+    while (_extraction->mask < 4 * (unsigned int)(_palette_size + 1)) {
+        _extraction->mask <<= 1;
+    }
+    _extraction->colors = calloc(_extraction->mask, sizeof(unsigned int));
+    --_extraction->mask;
+
+    _extraction->line = verbose ? malloc(_configuration->width + 1) : NULL;
+
+    if (verbose&&debug) {
+        print_output("\nExtracting color palette from source image.\n\n");
+    }
+
+}
+
+// This function continues the extraction of the palette of colors with the
+// given rows of pixels, from left to right and from top to bottom. It 
+// returns 0 as soon as more than palette_size colors are found. In debug 
+// mode, a line is shown for each row ("*" for the colors already found), 
+// built into a buffer and written at once.
+
+int extract_colors_from_rows(PaletteExtraction* _extraction, unsigned char* _source, int _row_size, int _rows) {
+
+    int image_x, image_y;
+    unsigned char* source;
+    unsigned int color, slot;
+    unsigned int* colors = _extraction->colors;
+    RGB* palette = _extraction->palette;
+    char* line = _extraction->line;
+    int length;
+
+    // Position of the red and blue components of each pixel
+    int red = _extraction->configuration->bgr ? 2 : 0;
+    int blue = 2 - red;
+
+    for (image_y = 0; image_y < _rows; ++image_y) {
+        source = _source + image_y * _row_size;
+        length = 0;
+        for (image_x = 0; image_x < _extraction->configuration->width; ++image_x) {
+            color = (((unsigned int)source[0] << 16) | ((unsigned int)source[1] << 8) | source[2]) + 1;
+
+            // Runs of pixels of the same color are very common,
+            // so the lookup is skipped for them.
+            if (color != _extraction->previous) {
+                slot = ((color * 2654435761u) >> 8) & _extraction->mask;
+                while (colors[slot] != 0 && colors[slot] != color) {
+                    slot = (slot + 1) & _extraction->mask;
+                }
+                if (colors[slot] == 0) {
+                    if (verbose && debug) {
+                        line[length++] = ' ';
+                    }
+                    if (_extraction->count == _extraction->palette_size) {
+                        ++_extraction->count;
+                        break;
+                    }
+                    colors[slot] = color;
+                    palette[_extraction->count].red = source[red];
+                    palette[_extraction->count].green = source[1];
+                    palette[_extraction->count].blue = source[blue];
+                    ++_extraction->count;
+                } else if (verbose && debug) {
+                    line[length++] = '*';
+                }
+                _extraction->previous = color;
+            } else if (verbose && debug) {
+                line[length++] = '*';
+            }
+            source += _extraction->configuration->depth;
+        }
+        if (verbose) {
+            line[length++] = '\n';
+            write_output(line, length);
+        }
+        if (_extraction->count > _extraction->palette_size) {
+            return 0;
+        }
+    }
+
+    return 1;
+
+}
+
+// This function ends the extraction of the palette of colors, and returns 
+// the number of colors found (palette_size + 1 if more).
+
+int finish_color_palette(PaletteExtraction* _extraction) {
+
+    int i;
+
+    free(_extraction->colors);
+    free(_extraction->line);
+
+    if (verbose && debug) {
+        print_output("\n\nDetected %d different colors.\n", _extraction->count);
+        for (i = 0; i < _extraction->count && i < _extraction->palette_size; ++i) {
+            print_output("%d) 0x%02.2x%02.2x%02.2x\n", i, _extraction->palette[i].red, _extraction->palette[i].green, _extraction->palette[i].blue );
+        }
+    }
+
+    return _extraction->count;
+
+}
+
+// This function extract the "palette" of colors of the given image, in the
+// order in which they are found (from left to right, from top to bottom).
+// The colors already found are kept in a small open addressing hash table, 
+// so each pixel costs a single lookup whatever the number of colors. If the
+// image has more than _palette_size colors, the scan stops as soon as the 
+// limit is exceeded and _palette_size + 1 is returned.
+int extract_color_palette(unsigned char* _source, Configuration* _configuration, RGB _palette[], int _palette_size) {
+
+    PaletteExtraction extraction;
+
+    start_color_palette(&extraction, _configuration, _palette, _palette_size);
+
+    extract_colors_from_rows(&extraction, _source, _configuration->row_size, _configuration->height);
+
+    return finish_color_palette(&extraction);
+
+}
+
+// This function completes the palette of colors extracted from an image 
+// (see analyze_image_colors): it moves the color nearest to the background
+// (if any) into the first position and finds the nearest retrocomputer 
+// color for each entry.
+
+void match_palette_colors(Configuration* _configuration, ColorAnalysis* _analysis) {
+
+    int j, k, m;
+    int minDistance, minColorIndex, distance;
+    RGB temp;
+    RGB* palette = _analysis->palette;
+
+    // Unused colors of the palette are black.
+    for (j = _analysis->colors_count; j < 4; ++j) {
+        palette[j].red = 0;
+        palette[j].green = 0;
+        palette[j].blue = 0;
+    }
+
+    if (verbose && debug) {
+        print_output("\n\nCalculating nearest colors.\n");
+    }
+    if (_configuration->background != -1) {
+        if (verbose && debug) {
+            print_output("\n\nStarting from background color.\n");
+        }
+        minDistance = 0xffff;
+        minColorIndex = 0;
+        for (k = 0; k < 4; ++k) {
+            distance = calculate_distance(palette[k], COLORS[_configuration->background].color);
+            if (verbose && debug) {
+                print_output("%d) 0x%02.2x%02.2x%02.2x => (%d) => %20.20s] 0x%02.2x%02.2x%02.2x\n", _configuration->background, 
+                    palette[k].red, palette[k].green, palette[k].blue,
+                    distance,
+                    COLORS[_configuration->background].name, COLORS[_configuration->background].color.red, COLORS[_configuration->background].color.green, COLORS[_configuration->background].color.blue);
+            }
+
+            if (distance < minDistance) {
+                minColorIndex = k;
+                minDistance = distance;
+            }
+        }
+        temp = palette[minColorIndex];
+        palette[minColorIndex] = palette[0];
+        palette[0] = temp;
+    }
+    for (j = 0; j < 4; ++j) {
+        minDistance = 0xffff;
+        minColorIndex = 0;
+        for (k = 0; k < sizeof(COLORS) / sizeof(NamedRGB); ++k) {
+            distance = calculate_distance(palette[j], COLORS[k].color);
+            if (verbose && debug) {
+                print_output("%d) %20.20s] 0x%02.2x%02.2x%02.2x => (%d) => 0x%02.2x%02.2x%02.2x\n", j, COLORS[k].name,
+                    palette[j].red, palette[j].green, palette[j].blue,
+                    distance,
+                    COLORS[k].color.red, COLORS[k].color.green, COLORS[k].color.blue);
+            }
+
+            if (distance < minDistance) {
+                for (m = 0; m < j; ++m) {
+                    if (_analysis->nearest_colors[m] == k) {
+                        break;
+                    }
+                }
+                if (m >= j) {
+                    minColorIndex = k;
+                    minDistance = distance;
+                }
+            }
+        }
+        if (verbose && debug) {
+            print_output("\n");
+            print_output("%d) 0x%02.2x%02.2x%02.2x => (%d) => 0x%02.2x%02.2x%02.2x\n", j,
+                palette[j].red, palette[j].green, palette[j].blue, 
+                minDistance,
+                COLORS[minColorIndex].color.red, COLORS[minColorIndex].color.green, COLORS[minColorIndex].color.blue);
+        }
+        _analysis->nearest_colors[j] = minColorIndex;
+    }
+    if (verbose && debug) {
+        print_output("\n");
+    }
+
+}
+
+// This function analyzes the colors of an image to be converted into 
+// multicolor tiles, once for each image: it extracts the palette (up to 4 
+// colors, in the order they are found), moves the color nearest to the 
+// background (if any) into the first position and finds the nearest 
+// retrocomputer color for each entry. The same palette is then used both 
+// for the conversion and for the C header. It returns the number of colors
+// found (5 means "more than 4"). The time taken is added to the given 
+// statistics, if any.
+
+int analyze_image_colors(unsigned char* _source, Configuration* _configuration, ColorAnalysis* _analysis, Statistics* _statistics) {
+
+    double start = _statistics != NULL ? start_phase() : 0;
+
+    _analysis->colors_count = extract_color_palette(_source, _configuration, _analysis->palette, 4);
+    if (_statistics != NULL) {
+        start = add_phase_time(&_statistics->palette, PHASE_PALETTE, start);
+    }
+    if (_analysis->colors_count > 4) {
+        return _analysis->colors_count;
+    }
+
+    match_palette_colors(_configuration, _analysis);
+    if (_statistics != NULL) {
+        add_phase_time(&_statistics->matching, PHASE_MATCHING, start);
+    }
+
+    return _analysis->colors_count;
+
+}
+
+// This function finds the index of the nearest color of the palette for a 
+// pixel, without using any SIMD instruction. Distances are compared as 
+// calculate_distance does (square root truncated to an integer), so that 
+// the first of two colors at the same "distance" is always choosen.
+
+int find_nearest_palette_index(unsigned char* _source, RGB _palette[]) {
+
+    int i, red, green, blue, distance;
+    int minDistance = 0xffff, colorIndex = 0;
+
+    for (i = 0; i < 4; ++i) {
+        red = _source[0] - _palette[i].red;
+        green = _source[1] - _palette[i].green;
+        blue = _source[2] - _palette[i].blue;
+        distance = (int)sqrt((double)(red * red + green * green + blue * blue));
+        if (distance < minDistance) {
+            minDistance = distance;
+            colorIndex = i;
+        }
+    }
+
+    return colorIndex;
+
+}
+
+// This function converts a band of 8 rows of pixels into a row of multicolor
+// tiles, without using any SIMD instruction. Tiles are converted one at a 
+// time, so that the 8 mixels of each tile are written contiguously.
+
+void convert_band_into_multicolor_tiles_scalar(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, RGB _palette[], mr_mixel* _destination) {
+
+    int i, j, mixel;
+    unsigned char* source;
+
+    for (; _count > 0; --_count) {
+        for (i = 0; i < 8; ++i) {
+            source = _source + i * _row_size;
+            mixel = 0;
+            for (j = 0; j < 4; ++j) {
+                mixel = (mixel << 2) | find_nearest_palette_index(source, _palette);
+                source += _depth;
+            }
+            _destination[i] = (mr_mixel)mixel;
+        }
+        _source += 4 * _depth;
+        _destination += 8;
+    }
+
+}
+
+#ifdef IMG2TILE_X86
+
+// This function calculates the distances of 4 pixels (given as 16-bit words
+// by _low and _high) from a color (given as 16-bit words, twice), truncated
+// as calculate_distance does. The square root in single precision is exact 
+// for this purpose, since the sum of squares never exceeds 3*255^2.
+
+TARGET_SSE2 static __m128i calculate_distances_sse2(__m128i _low, __m128i _high, __m128i _color) {
+
+    __m128i low = _mm_sub_epi16(_low, _color);
+    __m128i high = _mm_sub_epi16(_high, _color);
+    __m128i squares;
+
+    // (dr^2+dg^2, db^2) for each pixel
+    low = _mm_madd_epi16(low, low);
+    high = _mm_madd_epi16(high, high);
+
+    squares = _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1)))
+    );
+
+    return _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(squares)));
+
+}
+
+// This function converts a band of 8 rows of pixels into a row of multicolor
+// tiles, using SSE2 instructions: the 4 pixels of a mixel are compared 
+// against all the 4 colors of the palette at once, and the 8 mixels of 
+// each tile are written at once as a 64-bit word. Since the kernel reads 
+// 16 bytes for each row, the last tiles of the image are left to the 
+// scalar kernel.
+
+TARGET_SSE2 void convert_band_into_multicolor_tiles_sse2(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, RGB _palette[], mr_mixel* _destination) {
+
+    __m128i colors[4];
+    __m128i zero = _mm_setzero_si128();
+    __m128i pixels, low, high, distance, minDistance, colorIndex, nearer;
+    unsigned char* source;
+    uint64_t tile;
+    int i, j, indexes;
+    int highest_row = _row_size > 0 ? 7 * _row_size : 0;
+
+    for (j = 0; j < 4; ++j) {
+        colors[j] = _mm_setr_epi16(
+            (short)_palette[j].red, (short)_palette[j].green, (short)_palette[j].blue, 0,
+            (short)_palette[j].red, (short)_palette[j].green, (short)_palette[j].blue, 0);
+    }
+
+    for (; _count > 0 && _source + highest_row + 16 <= _end; --_count) {
+        tile = 0;
+        for (i = 0, source = _source; i < 8; ++i, source += _row_size) {
+            pixels = load_pixels_sse2(source, _depth);
+            low = _mm_unpacklo_epi8(pixels, zero);
+            high = _mm_unpackhi_epi8(pixels, zero);
+
+            minDistance = calculate_distances_sse2(low, high, colors[0]);
+            colorIndex = zero;
+            for (j = 1; j < 4; ++j) {
+                distance = calculate_distances_sse2(low, high, colors[j]);
+                nearer = _mm_cmplt_epi32(distance, minDistance);
+                minDistance = _mm_or_si128(_mm_and_si128(nearer, distance), _mm_andnot_si128(nearer, minDistance));
+                colorIndex = _mm_or_si128(_mm_and_si128(nearer, _mm_set1_epi32(j)), _mm_andnot_si128(nearer, colorIndex));
+            }
+
+            // One color index for each byte, from the leftmost pixel.
+            indexes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(colorIndex, zero), zero));
+            tile |= (uint64_t)(((indexes & 0x03) << 6) | ((indexes >> 4) & 0x30) | ((indexes >> 14) & 0x0c) | ((indexes >> 24) & 0x03)) << (i * 8);
+        }
+        memcpy(_destination, &tile, 8);
+        _source += 4 * _depth;
+        _destination += 8;
+    }
+
+    convert_band_into_multicolor_tiles_scalar(_source, _end, _row_size, _depth, _count, _palette, _destination);
+
+}
+
+#endif
+
+// This function converts a band of 8 rows of pixels into a row of multicolor
+// tiles, using the best kernel available. 
+
+void convert_band_into_multicolor_tiles(unsigned char* _source, unsigned char* _end, int _row_size, int _depth, int _count, RGB _palette[], mr_mixel* _destination) {
+
+#ifdef IMG2TILE_X86
+    if ((_depth == 3 || _depth == 4) && simd_level != SIMD_NONE) {
+        convert_band_into_multicolor_tiles_sse2(_source, _end, _row_size, _depth, _count, _palette, _destination);
+        return;
+    }
+#endif
+
+    convert_band_into_multicolor_tiles_scalar(_source, _end, _row_size, _depth, _count, _palette, _destination);
+
+}
+
+// This function converts the row of multicolor tiles _index of an image.
+
+void convert_multicolor_band_task(int _index, void* _context) {
+
+    ImageBands* bands = (ImageBands*)_context;
+
+    convert_band_into_multicolor_tiles(bands->source + _index * 8 * bands->row_size, bands->end, bands->row_size, bands->depth, bands->width_tiles, bands->palette, bands->tiles + _index * 8 * bands->width_tiles);
+
+}
+
+// This function copies the palette of an image for the kernels: if the 
+// pixels are in blue, green, red order, the kernels are given the palette
+// in the same order (distances do not change).
+
+void prepare_kernel_palette(Configuration* _configuration, ColorAnalysis* _analysis, RGB _palette[]) {
+
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        _palette[i] = _analysis->palette[i];
+        if (_configuration->bgr) {
+            _palette[i].red = _analysis->palette[i].blue;
+            _palette[i].blue = _analysis->palette[i].red;
+        }
+    }
+
+}
+
+// This function convert an image of (W,H) pixels in a set of (WT,HT) multicolor
+// tiles. Each tile will have the half of horizontal resolution but four colors
+// for each pixel. Tiles will be drawn in a "contiguous" way, i.e. each row of 
+// multicolor tiles will be drawn sequentially, and each column for each row 
+// the same. The image is converted a tile at a time, as for the other tiles.
+// The palette used is the one calculated by analyze_image_colors, and tiles
+// are written starting from _starting_tile, into the (already allocated) 
+// output.
+void convert_image_into_multicolor_tiles(unsigned char* _source, Configuration* _configuration, ColorAnalysis* _analysis, Output* _output, int _starting_tile) {
+
+    // Palette, in the same order of the components of the pixels
+    RGB palette[4];
+
+    // Rows of tiles to convert
+    ImageBands bands;
+
+    prepare_kernel_palette(_configuration, _analysis, palette);
+
+    bands.source = _source;
+    bands.end = get_pixels_end(_source, _configuration);
+    bands.row_size = _configuration->row_size;
+    bands.depth = _configuration->depth;
+    bands.width_tiles = _configuration->width_tiles;
+    bands.threshold = NULL;
+    bands.palette = palette;
+    bands.tiles = _output->tiles + (_starting_tile * 8);
+
+    run_in_parallel(count_band_threads(_configuration), _configuration->height_tiles, NULL, convert_multicolor_band_task, &bands);
+
+}
+
+// This function mirrors a tile horizontally, by reversing the order of the
+// pixels of each mixel with the given table.
+
+uint64_t mirror_tile(uint64_t _tile, const unsigned char _reverse[]) {
+
+    int i;
+    uint64_t result = 0;
+
+    for (i = 0; i < 64; i += 8) {
+        result |= (uint64_t)_reverse[(_tile >> i) & 0xff] << i;
+    }
+
+    return result;
+
+}
+
+// This function flips a tile vertically, by reversing the order of its
+// mixels (bytes).
+
+uint64_t flip_tile(uint64_t _tile) {
+
+    _tile = ((_tile & 0x00ff00ff00ff00ffULL) << 8) | ((_tile >> 8) & 0x00ff00ff00ff00ffULL);
+    _tile = ((_tile & 0x0000ffff0000ffffULL) << 16) | ((_tile >> 16) & 0x0000ffff0000ffffULL);
+    return (_tile << 32) | (_tile >> 32);
+
+}
+
+// This function calculates the canonical form of a tile, that is the 
+// smallest between the tile and its mirrored / flipped versions. It 
+// returns the flip flags that transform the tile into the canonical form
+// (and, since each of them is its own inverse, vice versa).
+
+int canonicalize_tile(uint64_t* _tile, const unsigned char _reverse[]) {
+
+    uint64_t variants[4];
+    int i, flags = 0;
+
+    variants[0] = *_tile;
+    variants[FLIP_HORIZONTAL] = mirror_tile(*_tile, _reverse);
+    variants[FLIP_VERTICAL] = flip_tile(*_tile);
+    variants[FLIP_HORIZONTAL | FLIP_VERTICAL] = flip_tile(variants[FLIP_HORIZONTAL]);
+
+    for (i = 1; i < 4; ++i) {
+        if (variants[i] < variants[flags]) {
+            flags = i;
+        }
+    }
+
+    *_tile = variants[flags];
+
+    return flags;
+
+}
+
+// This function removes the duplicated tiles from the output. Since a tile
+// is 8 bytes, it is used as a 64-bit key of an open addressing hash table
+// of the tiles already kept. Only the first copy of each tile is kept, and
+// the index of the (unique) tile used by each cell of the images is put
+// into the tile map, in the same order of the original tiles. With 
+// DEDUPLICATE_FLIPS each tile is first replaced by its canonical form, and
+// the flip flags needed to draw the original tile are put into the map.
+
+void deduplicate_tiles(Output* _output, int _mode, int _multicolor) {
+
+    int i, unique = 0, flags = 0;
+    int count = _output->tiles_count;
+    uint64_t tile, kept;
+    const unsigned char* reverse = _multicolor ? REVERSE_PAIRS : REVERSE_BITS;
+
+    // Hash table of the tiles kept, as indexes plus one (so that zero is
+    // an empty slot). It is kept at most half full. The slot of a tile is 
+    // taken from the top bits of its hash, as many as needed for the size
+    // of the table.
+    int* slots;
+    unsigned int slot, mask = 1;
+    int shift = 63;
+
+    while (mask < 2 * (unsigned int)count) {
+        mask <<= 1;
+        --shift;
+    }
+    slots = calloc(mask, sizeof(int));
+    --mask;
+
+    _output->map = malloc(sizeof(int) * (count > 0 ? count : 1));
+    _output->map_count = count;
+    if (_mode == DEDUPLICATE_FLIPS) {
+        _output->flips = malloc(count > 0 ? count : 1);
+    }
+
+    for (i = 0; i < count; ++i) {
+        memcpy(&tile, _output->tiles + i * 8, 8);
+        if (_mode == DEDUPLICATE_FLIPS) {
+            flags = canonicalize_tile(&tile, reverse);
+        }
+        slot = (unsigned int)((tile * 0x9E3779B97F4A7C15ULL) >> shift) & mask;
+        while (slots[slot] != 0) {
+            memcpy(&kept, _output->tiles + (slots[slot] - 1) * 8, 8);
+            if (kept == tile) {
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0) {
+            // Unique tiles are moved down, over the duplicated ones.
+            memcpy(_output->tiles + unique * 8, &tile, 8);
+            slots[slot] = ++unique;
+        }
+        _output->map[i] = slots[slot] - 1;
+        if (_output->flips != NULL) {
+            _output->flips[i] = (unsigned char)flags;
+        }
+    }
+
+    free(slots);
+
+    if (verbose) {
+        printf("Removed %d duplicated tiles.\n", count - unique);
+    }
+
+    _output->tiles_count = unique;
+
+}
+
+// This function reads an open file into memory, a piece at a time: it is
+// used when a file cannot be mapped (for example, if it is a pipe). As for
+// mapped files, files larger than INT_MAX bytes cannot be decoded. It 
+// returns 0 if it is unable to read the file.
+
+int read_file(FILE* _handle, MappedFile* _file) {
+
+    size_t size = 65536, read;
+    unsigned char* data;
+
+    _file->data = malloc(size);
+    _file->size = 0;
+    _file->mapped = 0;
+
+    if (_file->data == NULL) {
+        return 0;
+    }
+
+    while ((read = fread(_file->data + _file->size, 1, size - _file->size, _handle)) > 0) {
+        _file->size += read;
+        if (_file->size > INT_MAX) {
+            break;
+        }
+        if (_file->size == size) {
+            size *= 2;
+            data = realloc(_file->data, size);
+            if (data == NULL) {
+                break;
+            }
+            _file->data = data;
+        }
+    }
+
+    if (ferror(_handle) || _file->size > INT_MAX || read > 0) {
+        free(_file->data);
+        _file->data = NULL;
+        return 0;
+    }
+
+    return 1;
+
+}
+
+// This function maps a file into memory, so that the image can be decoded
+// without copying it (by stbi_load_from_memory). The system is told that
+// the file will be read sequentially. If the file cannot be mapped, it is 
+// read into memory. The server always reads files into memory: a mapped
+// file truncated while in use (for example, rewritten by an editor) would
+// terminate the process, instead of failing the request. It returns 0 if
+// it is unable to do either.
+
+int map_file(char* _filename, MappedFile* _file) {
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(_filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    HANDLE mapping;
+    LARGE_INTEGER size;
+    FILE* handle;
+
+    _file->data = NULL;
+    if (file != INVALID_HANDLE_VALUE) {
+        if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= INT_MAX) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL) {
+                // The view remains valid after closing the handles.
+                _file->data = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                _file->size = (size_t)size.QuadPart;
+                _file->mapped = 1;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+
+    if (_file->data == NULL) {
+        handle = fopen(_filename, "rb");
+        if (handle == NULL) {
+            return 0;
+        }
+        if (!read_file(handle, _file)) {
+            fclose(handle);
+            return 0;
+        }
+        fclose(handle);
+    }
+#else
+    struct stat status;
+    int file = open(_filename, O_RDONLY);
+    FILE* handle;
+
+    _file->data = NULL;
+    if (file < 0) {
+        return 0;
+    }
+    if (!serving && fstat(file, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0 && status.st_size <= INT_MAX) {
+        void* data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t)status.st_size, MADV_SEQUENTIAL);
+            _file->data = (unsigned char*)data;
+            _file->size = (size_t)status.st_size;
+            _file->mapped = 1;
+        }
+    }
+
+    if (_file->data == NULL) {
+        // A pipe can be opened only once: so, it is read from the same
+        // descriptor.
+        handle = fdopen(file, "rb");
+        if (handle == NULL) {
+            close(file);
+            return 0;
+        }
+        if (!read_file(handle, _file)) {
+            fclose(handle);
+            return 0;
+        }
+        fclose(handle);
+        return 1;
+    }
+
+    // The mapping remains valid after closing the file.
+    close(file);
+#endif
+
+    return 1;
+
+}
+
+// This function tells the system that a mapped file is going to be read 
+// soon (as a whole), so that it can be read in advance.
+
+void prefetch_file(MappedFile* _file) {
+
+#ifndef _WIN32
+    if (_file->mapped) {
+        madvise(_file->data, _file->size, MADV_WILLNEED);
+    }
+#endif
+
+}
+
+// This function releases a file mapped (or read) into memory.
+
+void unmap_file(MappedFile* _file) {
+
+    if (_file->data == NULL) {
+        return;
+    }
+
+    if (_file->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(_file->data);
+#else
+        munmap(_file->data, _file->size);
+#endif
+    } else {
+        free(_file->data);
+    }
+
+    _file->data = NULL;
+    _file->size = 0;
+
+}
+
+// This function reads a little endian number of 16 bits.
+
+unsigned int read_le16(unsigned char* _data) {
+
+    return (unsigned int)_data[0] | ((unsigned int)_data[1] << 8);
+
+}
+
+// This function reads a little endian number of 32 bits.
+
+unsigned int read_le32(unsigned char* _data) {
+
+    return read_le16(_data) | (read_le16(_data + 2) << 16);
+
+}
+
+// This function tells that the pixels of an image can be read directly
+// from its (mapped) file, if they are all into the file: the rows of the
+// image start at _offset, each one _stride bytes after the previous one,
+// from the bottom one if _bottom_up. It returns 0 if it is not possible.
+
+int use_raw_pixels(SharedImage* _image, long long _width, long long _height, int _depth, long long _offset, long long _stride, int _bottom_up, int _bgr) {
+
+    if (_width < 1 || _height < 1 || _width > STBI_MAX_DIMENSIONS || _height > STBI_MAX_DIMENSIONS ||
+        _offset + (_height - 1) * _stride + _width * _depth > (long long)_image->file.size) {
+        return 0;
+    }
+
+    _image->raw = 1;
+    _image->width = (int)_width;
+    _image->height = (int)_height;
+    _image->depth = _depth;
+    _image->bgr = _bgr;
+    if (_bottom_up) {
+        _image->raw_offset = (size_t)(_offset + (_height - 1) * _stride);
+        _image->row_size = -(int)_stride;
+    } else {
+        _image->raw_offset = (size_t)_offset;
+        _image->row_size = (int)_stride;
+    }
+
+    return 1;
+
+}
+
+// This function checks if an image is an uncompressed BMP with 24 or 32
+// bits for each pixel (in blue, green, red order). Only the headers that
+// stb_image reads with the same depth are accepted (alpha masks are used 
+// only by larger headers).
+
+int find_bmp_pixels(SharedImage* _image) {
+
+    unsigned char* data = _image->file.data;
+    unsigned int header_size, alpha_mask;
+    int bits, width, height;
+
+    if (_image->file.size < 54 || data[0] != 'B' || data[1] != 'M') {
+        return 0;
+    }
+
+    header_size = read_le32(data + 14);
+    width = (int)read_le32(data + 18);
+    height = (int)read_le32(data + 22);
+    bits = read_le16(data + 28);
+
+    if (read_le16(data + 26) != 1 || read_le32(data + 30) != 0 || (bits != 24 && bits != 32) ||
+        read_le32(data + 10) != 14 + header_size || height == INT_MIN) {
+        return 0;
+    }
+
+    if (header_size != 40) {
+        if (bits != 24 || (header_size != 108 && header_size != 124) || _image->file.size < 14 + header_size) {
+            return 0;
+        }
+        alpha_mask = read_le32(data + 66);
+        if (alpha_mask != 0 && alpha_mask != 0xff000000) {
+            return 0;
+        }
+    }
+
+    // Rows are aligned to 4 bytes, and go from the bottom one unless the
+    // height is negative.
+    return use_raw_pixels(_image, width, height < 0 ? -height : height, bits / 8,
+        14 + header_size, ((long long)width * (bits / 8) + 3) & ~3LL, height > 0, 1);
+
+}
+
+// This function checks if an image is a binary PPM with 8 bits for each
+// component (or a binary PGM, if its colors are not needed). The header is
+// read as stb_image does: whitespaces and comments between the numbers, 
+// and a single character after the last one.
+
+int find_pnm_pixels(SharedImage* _image) {
+
+    unsigned char* data = _image->file.data;
+    size_t size = _image->file.size, position = 2;
+    long long values[3];
+    int i, depth;
+
+    if (size < 3 || data[0] != 'P' || (data[1] != '6' && (data[1] != '5' || _image->colors))) {
+        return 0;
+    }
+
+    depth = data[1] == '6' ? 3 : 1;
+
+    for (i = 0; i < 3; ++i) {
+        for (;;) {
+            while (position < size && isspace(data[position])) {
+                ++position;
+            }
+            if (position >= size || data[position] != '#') {
+                break;
+            }
+            while (position < size && data[position] != '\n' && data[position] != '\r') {
+                ++position;
+            }
+        }
+        if (position >= size || !isdigit(data[position])) {
+            return 0;
+        }
+        for (values[i] = 0; position < size && isdigit(data[position]); ++position) {
+            values[i] = values[i] * 10 + (data[position] - '0');
+            if (values[i] > STBI_MAX_DIMENSIONS) {
+                return 0;
+            }
+        }
+    }
+
+    if (values[2] > 255) {
+        return 0;
+    }
+
+    return use_raw_pixels(_image, values[0], values[1], depth, (long long)position + 1, values[0] * depth, 0, 0);
+
+}
+
+// This function checks if an image is an uncompressed true color TGA, with 
+// 24 or 32 bits for each pixel (in blue, green, red order). Rows go from
+// the bottom one, unless the descriptor tells otherwise.
+
+int find_tga_pixels(SharedImage* _image) {
+
+    unsigned char* data = _image->file.data;
+    int depth;
+
+    // A colormap type of zero excludes any other format known by stb_image.
+    if (_image->file.size < 18 || data[1] != 0 || data[2] != 2 || (data[16] != 24 && data[16] != 32)) {
+        return 0;
+    }
+
+    depth = data[16] / 8;
+
+    return use_raw_pixels(_image, read_le16(data + 12), read_le16(data + 14), depth,
+        18 + data[0], (long long)read_le16(data + 12) * depth, (data[17] & 0x20) == 0, 1);
+
+}
+
+// This function checks if the pixels of an image can be read directly from
+// its file, without decoding it (and without allocating memory for them).
+// In this case, the sizes of the image and the position of its pixels are
+// set, and 1 is returned.
+
+int find_raw_pixels(SharedImage* _image) {
+
+    return find_bmp_pixels(_image) || find_pnm_pixels(_image) || find_tga_pixels(_image);
+
+}
+
+// This function gives back to the system the memory used by some bytes of
+// a mapped file, that are not needed anymore (they are read again from the
+// file, if needed). It does nothing if the file is not mapped.
+
+void release_file_pages(MappedFile* _file, unsigned char* _start, unsigned char* _end) {
+
+#ifndef _WIN32
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char* start;
+
+    if (_file->mapped) {
+        start = _file->data + ((size_t)(_start - _file->data) & ~(page_size - 1));
+        madvise(start, (size_t)(_end - start), MADV_DONTNEED);
+    }
+#endif
+
+}
+
+// This function reads a big endian number of 32 bits.
+
+unsigned int read_be32(unsigned char* _data) {
+
+    return ((unsigned int)_data[0] << 24) | ((unsigned int)_data[1] << 16) | ((unsigned int)_data[2] << 8) | _data[3];
+
+}
+
+// This function reads the chunks of a PNG image up to the first IDAT one:
+// the header, the palette and the transparent color (or the transparency
+// of the palette). The chunks are read as stb_image does, and the depth of 
+// the decoded image is calculated in the same way (the palette and the 
+// transparent color add components). If a stream is given, it is prepared
+// to read the compressed data. It returns 0 if the image cannot be decoded
+// a band of rows at a time (interlaced images, unknown chunks and so on).
+
+int read_png_chunks(SharedImage* _image, PngStream* _stream) {
+
+    unsigned char* data = _image->file.data;
+    size_t size = _image->file.size, position = 33;
+    unsigned int width, height, length, i;
+    int bit_depth, color, channels, palette_count = 0, transparent = 0;
+
+    if (size < 33 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0 || read_be32(data + 8) != 13 || memcmp(data + 12, "IHDR", 4) != 0) {
+        return 0;
+    }
+
+    width = read_be32(data + 16);
+    height = read_be32(data + 20);
+    bit_depth = data[24];
+    color = data[25];
+
+    if (width < 1 || height < 1 || width > STBI_MAX_DIMENSIONS || height > STBI_MAX_DIMENSIONS ||
+        data[26] != 0 || data[27] != 0 || data[28] != 0) {
+        return 0;
+    }
+
+    switch (color) {
+        case 0:
+            channels = 1;
+            if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8 && bit_depth != 16) {
+                return 0;
+            }
+            break;
+        case 3:
+            channels = 1;
+            if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8) {
+                return 0;
+            }
+            break;
+        case 2:
+        case 4:
+        case 6:
+            channels = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+            if (bit_depth != 8 && bit_depth != 16) {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    if (_stream != NULL) {
+        memset(_stream->palette, 0, sizeof(_stream->palette));
+    }
+
+    for (;;) {
+        if (position + 12 > size) {
+            return 0;
+        }
+        length = read_be32(data + position);
+        if (length > size - position - 12) {
+            return 0;
+        }
+        if (memcmp(data + position + 4, "IDAT", 4) == 0) {
+            break;
+        } else if (memcmp(data + position + 4, "PLTE", 4) == 0) {
+            if (length > 256 * 3 || length % 3 != 0) {
+                return 0;
+            }
+            palette_count = length / 3;
+            for (i = 0; _stream != NULL && i < 256; ++i) {
+                if (i < (unsigned int)palette_count) {
+                    memcpy(&_stream->palette[i * 4], data + position + 8 + i * 3, 3);
+                }
+                _stream->palette[i * 4 + 3] = 255;
+            }
+        } else if (memcmp(data + position + 4, "tRNS", 4) == 0) {
+            if (color == 3) {
+                if (palette_count == 0 || length > (unsigned int)palette_count) {
+                    return 0;
+                }
+                for (i = 0; _stream != NULL && i < length; ++i) {
+                    _stream->palette[i * 4 + 3] = data[position + 8 + i];
+                }
+            } else if (color == 4 || color == 6 || length != (unsigned int)channels * 2) {
+                return 0;
+            } else if (_stream != NULL) {
+                for (i = 0; i < (unsigned int)channels; ++i) {
+                    _stream->transparent_color[i] = (unsigned short)((data[position + 8 + i * 2] << 8) | data[position + 9 + i * 2]);
+                    if (bit_depth < 16) {
+                        _stream->transparent_color[i] = (unsigned char)((_stream->transparent_color[i] & 255) * PNG_GREY_SCALE[bit_depth]);
+                    }
+                }
+            }
+            transparent = 1;
+        } else if ((data[position + 4] & 0x20) == 0 || memcmp(data + position + 4, "CgBI", 4) == 0) {
+            // Unknown critical chunks (and the ones of Apple) are left to 
+            // stb_image.
+            return 0;
+        }
+        position += 12 + length;
+    }
+
+    if (color == 3 && palette_count == 0) {
+        return 0;
+    }
+
+    _image->width = (int)width;
+    _image->height = (int)height;
+    _image->depth = color == 3 ? 3 + transparent : channels + transparent;
+
+    if (_stream != NULL) {
+        _stream->data = data;
+        _stream->size = size;
+        _stream->position = position + 8;
+        _stream->chunk_end = position + 8 + length;
+        _stream->overrun = 0;
+        _stream->bits = 0;
+        _stream->bits_count = 0;
+        _stream->written = 0;
+        _stream->flushed = 0;
+        _stream->width = (int)width;
+        _stream->height = (int)height;
+        _stream->bit_depth = bit_depth;
+        _stream->color = color;
+        _stream->channels = channels;
+        _stream->depth = _image->depth;
+        _stream->transparent = transparent;
+        _stream->line_size = (int)(((long long)width * channels * bit_depth + 7) / 8);
+        _stream->filter_bytes = channels * bit_depth >= 8 ? channels * bit_depth / 8 : 1;
+        _stream->line_position = 0;
+        _stream->row = 0;
+        _stream->stopped = 0;
+    }
+
+    return 1;
+
+}
+
+// This function checks if a PNG image can be decoded a band of rows at a 
+// time (see read_png_chunks), and sets its sizes if so. Grey images are 
+// left to stb_image if their colors are needed, since the multicolor 
+// converter needs three components.
+
+int find_png_stream(SharedImage* _image) {
+
+    SharedImage image = *_image;
+
+    if (!read_png_chunks(&image, NULL) || (image.depth < 3 && _image->colors)) {
+        return 0;
+    }
+
+    *_image = image;
+
+    return 1;
+
+}
+
+// This function reads the next byte of the compressed data of a PNG image,
+// going through its IDAT chunks (each one has its length and type before,
+// and its CRC after). After the last one, zeros are read (and counted).
+
+unsigned int read_png_byte(PngStream* _stream) {
+
+    size_t length;
+
+    while (_stream->chunk_end != 0 && _stream->position == _stream->chunk_end) {
+        _stream->position += 4;
+        if (_stream->position + 8 <= _stream->size && memcmp(_stream->data + _stream->position + 4, "IDAT", 4) == 0) {
+            length = read_be32(_stream->data + _stream->position);
+            _stream->position += 8;
+            _stream->chunk_end = _stream->position + (length < _stream->size - _stream->position ? length : _stream->size - _stream->position);
+        } else {
+            _stream->chunk_end = 0;
+        }
+    }
+
+    if (_stream->chunk_end == 0) {
+        ++_stream->overrun;
+        return 0;
+    }
+
+    return _stream->data[_stream->position++];
+
+}
+
+// This function reads the given number of bits (up to 16) of the compressed
+// data of a PNG image, from the least significant one.
+
+unsigned int read_png_bits(PngStream* _stream, int _count) {
+
+    unsigned int value;
+
+    while (_stream->bits_count <= 24) {
+        _stream->bits |= read_png_byte(_stream) << _stream->bits_count;
+        _stream->bits_count += 8;
+    }
+
+    value = _stream->bits & ((1u << _count) - 1);
+    _stream->bits >>= _count;
+    _stream->bits_count -= _count;
+
+    return value;
+
+}
+
+// This function prepares a Huffman code of the deflate format, given the
+// length of the code of each symbol. It returns 0 if the lengths are not
+// valid.
+
+int build_huffman_code(HuffmanCode* _code, unsigned char* _lengths, int _count) {
+
+    unsigned short offsets[16];
+    int i, j, length, left = 1, code = 0, index = 0, reversed;
+
+    memset(_code->counts, 0, sizeof(_code->counts));
+    memset(_code->fast, 0, sizeof(_code->fast));
+
+    for (i = 0; i < _count; ++i) {
+        ++_code->counts[_lengths[i]];
+    }
+    _code->counts[0] = 0;
+
+    // The code cannot have more codes than possible for each length.
+    for (length = 1; length < 16; ++length) {
+        left = (left << 1) - _code->counts[length];
+        if (left < 0) {
+            return 0;
+        }
+    }
+
+    offsets[1] = 0;
+    for (length = 1; length < 15; ++length) {
+        offsets[length + 1] = offsets[length] + _code->counts[length];
+    }
+    for (i = 0; i < _count; ++i) {
+        if (_lengths[i] != 0) {
+            _code->symbols[offsets[_lengths[i]]++] = (unsigned short)i;
+        }
+    }
+
+    // Codes are read from the least significant bit, so they are reversed 
+    // into the table.
+    for (length = 1; length <= 9; ++length) {
+        for (i = 0; i < _code->counts[length]; ++i, ++code, ++index) {
+            for (reversed = 0, j = 0; j < length; ++j) {
+                reversed |= ((code >> j) & 1) << (length - 1 - j);
+            }
+            for (j = reversed; j < 512; j += 1 << length) {
+                _code->fast[j] = (unsigned short)((length << 9) | _code->symbols[index]);
+            }
+        }
+        code <<= 1;
+    }
+
+    return 1;
+
+}
+
+// This function reads a symbol of the compressed data of a PNG image, with
+// the given Huffman code. Codes longer than 9 bits are read a bit at a time.
+// It returns -1 if the code is not valid.
+
+int read_png_symbol(PngStream* _stream, HuffmanCode* _code) {
+
+    int entry, length, code = 0, first = 0, index = 0, count;
+
+    while (_stream->bits_count <= 24) {
+        _stream->bits |= read_png_byte(_stream) << _stream->bits_count;
+        _stream->bits_count += 8;
+    }
+
+    entry = _code->fast[_stream->bits & 511];
+    if (entry != 0) {
+        length = entry >> 9;
+        _stream->bits >>= length;
+        _stream->bits_count -= length;
+        return entry & 511;
+    }
+
+    for (length = 1; length < 16; ++length) {
+        code |= (_stream->bits >> (length - 1)) & 1;
+        count = _code->counts[length];
+        if (code - count < first) {
+            _stream->bits >>= length;
+            _stream->bits_count -= length;
+            return _code->symbols[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+
+    return -1;
+
+}
+
+// This function returns the Paeth predictor of the PNG filters.
+
+int paeth_predictor(int _left, int _above, int _above_left) {
+
+    int estimate = _left + _above - _above_left;
+    int left = abs(estimate - _left), above = abs(estimate - _above), above_left = abs(estimate - _above_left);
+
+    if (left <= above && left <= above_left) {
+        return _left;
+    }
+
+    return above <= above_left ? _above : _above_left;
+
+}
+
+// This function converts a row of a PNG image (without its filter) into 
+// pixels with 8 bits for each component, as stb_image does: 16 bits values
+// are truncated, grey values with less bits are scaled, colors of the 
+// palette are expanded and the transparent color adds an alpha component.
+
+void expand_png_row(PngStream* _stream, unsigned char* _destination) {
+
+    unsigned char* line = _stream->line + 1;
+    unsigned short* transparent_color = _stream->transparent_color;
+    int x, k, value, opaque;
+
+    if (_stream->color == 3 || _stream->bit_depth < 8) {
+        for (x = 0; x < _stream->width; ++x) {
+            if (_stream->bit_depth == 8) {
+                value = line[x];
+            } else {
+                k = x * _stream->bit_depth;
+                value = (line[k >> 3] >> (8 - _stream->bit_depth - (k & 7))) & ((1 << _stream->bit_depth) - 1);
+            }
+            if (_stream->color == 3) {
+                memcpy(_destination, &_stream->palette[value * 4], _stream->depth);
+            } else {
+                _destination[0] = (unsigned char)(value * PNG_GREY_SCALE[_stream->bit_depth]);
+                if (_stream->transparent) {
+                    _destination[1] = _destination[0] == transparent_color[0] ? 0 : 255;
+                }
+            }
+            _destination += _stream->depth;
+        }
+    } else if (_stream->bit_depth == 16) {
+        for (x = 0; x < _stream->width; ++x) {
+            opaque = 0;
+            for (k = 0; k < _stream->channels; ++k) {
+                _destination[k] = line[k * 2];
+                opaque |= ((line[k * 2] << 8) | line[k * 2 + 1]) != transparent_color[k];
+            }
+            if (_stream->transparent) {
+                _destination[k] = opaque ? 255 : 0;
+            }
+            line += _stream->channels * 2;
+            _destination += _stream->depth;
+        }
+    } else if (!_stream->transparent) {
+        memcpy(_destination, line, (size_t)_stream->width * _stream->channels);
+    } else {
+        for (x = 0; x < _stream->width; ++x) {
+            opaque = 0;
+            for (k = 0; k < _stream->channels; ++k) {
+                _destination[k] = line[k];
+                opaque |= line[k] != transparent_color[k];
+            }
+            _destination[k] = opaque ? 255 : 0;
+            line += _stream->channels;
+            _destination += _stream->depth;
+        }
+    }
+
+}
+
+// This function removes the filter from the row of a PNG image just read, 
+// using the previous one, and puts its pixels into the band of rows. When
+// the band is full (or the image ends), it is given to the callback.
+
+void finish_png_row(PngStream* _stream) {
+
+    unsigned char* line = _stream->line + 1;
+    unsigned char* previous = _stream->previous + 1;
+    unsigned char* swap;
+    int i, bytes = _stream->filter_bytes, row_size = _stream->width * _stream->depth;
+
+    switch (_stream->line[0]) {
+        case 0:
+            break;
+        case 1:
+            for (i = bytes; i < _stream->line_size; ++i) {
+                line[i] += line[i - bytes];
+            }
+            break;
+        case 2:
+            for (i = 0; i < _stream->line_size; ++i) {
+                line[i] += previous[i];
+            }
+            break;
+        case 3:
+            for (i = 0; i < bytes; ++i) {
+                line[i] += previous[i] >> 1;
+            }
+            for (; i < _stream->line_size; ++i) {
+                line[i] += (line[i - bytes] + previous[i]) >> 1;
+            }
+            break;
+        case 4:
+            for (i = 0; i < bytes; ++i) {
+                line[i] += previous[i];
+            }
+            for (; i < _stream->line_size; ++i) {
+                line[i] += (unsigned char)paeth_predictor(line[i - bytes], previous[i], previous[i - bytes]);
+            }
+            break;
+        default:
+            _stream->stopped = -1;
+            return;
+    }
+
+    expand_png_row(_stream, _stream->band + (_stream->row & 7) * row_size);
+
+    ++_stream->row;
+    if ((_stream->row & 7) == 0 || _stream->row == _stream->height) {
+        if (!_stream->callback(_stream->band, row_size, ((_stream->row - 1) & 7) + 1, (_stream->row - 1) >> 3, _stream->context)) {
+            _stream->stopped = 1;
+        }
+    }
+
+    swap = _stream->line;
+    _stream->line = _stream->previous;
+    _stream->previous = swap;
+
+}
+
+// This function gives the bytes decompressed (and not given yet) to the 
+// rows of a PNG image. It returns 0 when no more bytes are needed.
+
+int flush_png_window(PngStream* _stream) {
+
+    unsigned int start, count;
+
+    while (_stream->flushed < _stream->written && _stream->stopped == 0 && _stream->row < _stream->height) {
+        start = (unsigned int)(_stream->flushed & 0xffff);
+        count = _stream->line_size + 1 - _stream->line_position;
+        if (count > 0x10000 - start) {
+            count = 0x10000 - start;
+        }
+        if (count > _stream->written - _stream->flushed) {
+            count = (unsigned int)(_stream->written - _stream->flushed);
+        }
+        memcpy(_stream->line + _stream->line_position, _stream->window + start, count);
+        _stream->line_position += count;
+        _stream->flushed += count;
+        if (_stream->line_position == _stream->line_size + 1) {
+            _stream->line_position = 0;
+            finish_png_row(_stream);
+        }
+    }
+
+    return _stream->stopped == 0 && _stream->row < _stream->height;
+
+}
+
+// This function decompresses a block of the deflate format, with the given
+// Huffman codes. Bytes are given to the rows of the image as soon as 32K
+// bytes are decompressed. It returns 0 if the block is not valid.
+
+int inflate_png_block(PngStream* _stream, HuffmanCode* _literals, HuffmanCode* _distances) {
+
+    int symbol, length, distance;
+
+    for (;;) {
+        symbol = read_png_symbol(_stream, _literals);
+        if (symbol < 0 || symbol > 285 || _stream->overrun > 8) {
+            return 0;
+        } else if (symbol < 256) {
+            _stream->window[_stream->written++ & 0xffff] = (unsigned char)symbol;
+        } else if (symbol == 256) {
+            return 1;
+        } else {
+            symbol -= 257;
+            length = DEFLATE_LENGTH_BASE[symbol] + read_png_bits(_stream, DEFLATE_LENGTH_EXTRA[symbol]);
+            symbol = read_png_symbol(_stream, _distances);
+            if (symbol < 0 || symbol > 29) {
+                return 0;
+            }
+            distance = DEFLATE_DISTANCE_BASE[symbol] + read_png_bits(_stream, DEFLATE_DISTANCE_EXTRA[symbol]);
+            if ((unsigned long long)distance > _stream->written) {
+                return 0;
+            }
+            for (; length > 0; --length, ++_stream->written) {
+                _stream->window[_stream->written & 0xffff] = _stream->window[(_stream->written - distance) & 0xffff];
+            }
+        }
+        if (_stream->written - _stream->flushed >= 0x8000 && !flush_png_window(_stream)) {
+            return 1;
+        }
+    }
+
+}
+
+// This function decompresses the data of a PNG image (in the zlib format), 
+// giving the bytes to the rows of the image, until all the rows are read.
+// The checksum at the end is not verified (as stb_image does). It returns
+// 0 if the data is not valid.
+
+int inflate_png_stream(PngStream* _stream) {
+
+    HuffmanCode literals, distances, lengths_code;
+    unsigned char lengths[288 + 32];
+    int final, type, i, count, symbol, literals_count, distances_count, lengths_count;
+    unsigned int header;
+
+    header = read_png_bits(_stream, 16);
+    if ((((header & 0xff) << 8) | (header >> 8)) % 31 != 0 || (header & 0x0f) != 8 || (header & 0x2000) != 0) {
+        return 0;
+    }
+
+    do {
+        final = read_png_bits(_stream, 1);
+        type = read_png_bits(_stream, 2);
+        if (type == 0) {
+            // Stored block, starting from the next byte.
+            read_png_bits(_stream, _stream->bits_count & 7);
+            count = read_png_bits(_stream, 16);
+            if ((unsigned int)count != (read_png_bits(_stream, 16) ^ 0xffff)) {
+                return 0;
+            }
+            for (; count > 0; --count) {
+                _stream->window[_stream->written++ & 0xffff] = (unsigned char)read_png_bits(_stream, 8);
+                if (_stream->written - _stream->flushed >= 0x8000 && !flush_png_window(_stream)) {
+                    break;
+                }
+            }
+        } else if (type == 1) {
+            // Fixed Huffman codes.
+            for (i = 0; i < 288; ++i) {
+                lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            }
+            memset(lengths + 288, 5, 30);
+            build_huffman_code(&literals, lengths, 288);
+            build_huffman_code(&distances, lengths + 288, 30);
+        } else if (type == 2) {
+            // Dynamic Huffman codes, given by their lengths (compressed 
+            // with another Huffman code).
+            literals_count = read_png_bits(_stream, 5) + 257;
+            distances_count = read_png_bits(_stream, 5) + 1;
+            lengths_count = read_png_bits(_stream, 4) + 4;
+            memset(lengths, 0, 19);
+            for (i = 0; i < lengths_count; ++i) {
+                lengths[DEFLATE_CODE_LENGTHS_ORDER[i]] = (unsigned char)read_png_bits(_stream, 3);
+            }
+            if (!build_huffman_code(&lengths_code, lengths, 19)) {
+                return 0;
+            }
+            for (i = 0; i < literals_count + distances_count; ) {
+                symbol = read_png_symbol(_stream, &lengths_code);
+                if (symbol < 0 || _stream->overrun > 8) {
+                    return 0;
+                } else if (symbol < 16) {
+                    lengths[i++] = (unsigned char)symbol;
+                    continue;
+                } else if (symbol == 16) {
+                    if (i == 0) {
+                        return 0;
+                    }
+                    count = 3 + read_png_bits(_stream, 2);
+                    symbol = lengths[i - 1];
+                } else if (symbol == 17) {
+                    count = 3 + read_png_bits(_stream, 3);
+                    symbol = 0;
+                } else {
+                    count = 11 + read_png_bits(_stream, 7);
+                    symbol = 0;
+                }
+                if (i + count > literals_count + distances_count) {
+                    return 0;
+                }
+                memset(lengths + i, symbol, count);
+                i += count;
+            }
+            if (!build_huffman_code(&literals, lengths, literals_count) ||
+                !build_huffman_code(&distances, lengths + literals_count, distances_count)) {
+                return 0;
+            }
+        } else {
+            return 0;
+        }
+        if (type != 0 && !inflate_png_block(_stream, &literals, &distances)) {
+            return 0;
+        }
+        if (_stream->overrun > 8) {
+            return 0;
+        }
+    } while (!final && flush_png_window(_stream));
+
+    flush_png_window(_stream);
+
+    return _stream->stopped > 0 || (_stream->stopped == 0 && _stream->row == _stream->height);
+
+}
+
+// This function decodes a PNG image a band of 8 rows at a time (the last 
+// band can have less rows), giving each band to the callback: only the 
+// last 32K bytes decompressed, two rows and a band of rows are kept into 
+// memory. It returns 0 if the image cannot be decoded.
+
+int decode_png_stream(SharedImage* _image, BandCallback _callback, void* _context) {
+
+    PngStream stream;
+    int result = 0;
+
+    if (!read_png_chunks(_image, &stream)) {
+        return 0;
+    }
+
+    stream.window = malloc(0x10000);
+    stream.line = malloc(stream.line_size + 1);
+    stream.previous = calloc(stream.line_size + 1, 1);
+    stream.band = malloc((size_t)8 * stream.width * stream.depth);
+    stream.callback = _callback;
+    stream.context = _context;
+
+    result = inflate_png_stream(&stream);
+
+    free(stream.window);
+    free(stream.line);
+    free(stream.previous);
+    free(stream.band);
+
+    return result;
+
+}
+
+// This function reads a streamed image (see share_images) a band of 8 rows
+// at a time (the last band can have less rows), giving each band to the 
+// callback. The pixels of raw images are read directly from the file, and
+// the memory used by each band is given back to the system after its use.
+// It returns 0 if the image cannot be decoded.
+
+int stream_image_bands(SharedImage* _image, BandCallback _callback, void* _context) {
+
+    unsigned char* source;
+    int index, rows, row_size = _image->row_size;
+
+    if (!_image->raw) {
+        return decode_png_stream(_image, _callback, _context);
+    }
+
+    for (index = 0; index * 8 < _image->height; ++index) {
+        source = _image->file.data + _image->raw_offset + (long long)index * 8 * row_size;
+        rows = _image->height - index * 8 < 8 ? _image->height - index * 8 : 8;
+        if (!_callback(source, row_size, rows, index, _context)) {
+            break;
+        }
+        if (row_size > 0) {
+            release_file_pages(&_image->file, source, source + (rows - 1) * row_size + _image->width * _image->depth);
+        } else {
+            release_file_pages(&_image->file, source + (rows - 1) * row_size, source + _image->width * _image->depth);
+        }
+    }
+
+    return 1;
+
+}
+
+// This function extracts the colors of a band of rows of a streamed image.
+// It returns 0 (to stop reading) if there are too many colors.
+
+int extract_streamed_band_colors(unsigned char* _source, int _row_size, int _rows, int _index, void* _context) {
+
+    return extract_colors_from_rows((PaletteExtraction*)_context, _source, _row_size, _rows);
+
+}
+
+// This function analyzes the colors of a streamed image, as 
+// analyze_image_colors does. It returns -1 if the image cannot be decoded.
+// The time taken to decode it is counted as extracting the palette.
+
+int analyze_streamed_image_colors(SharedImage* _image, Configuration* _configuration, ColorAnalysis* _analysis, Statistics* _statistics) {
+
+    PaletteExtraction extraction;
+    int decoded;
+    double start = _statistics != NULL ? start_phase() : 0;
+
+    start_color_palette(&extraction, _configuration, _analysis->palette, 4);
+
+    decoded = stream_image_bands(_image, extract_streamed_band_colors, &extraction);
+
+    _analysis->colors_count = finish_color_palette(&extraction);
+    if (_statistics != NULL) {
+        start = add_phase_time(&_statistics->palette, PHASE_PALETTE, start);
+    }
+    if (!decoded) {
+        return -1;
+    }
+    if (_analysis->colors_count > 4) {
+        return _analysis->colors_count;
+    }
+
+    match_palette_colors(_configuration, _analysis);
+    if (_statistics != NULL) {
+        add_phase_time(&_statistics->matching, PHASE_MATCHING, start);
+    }
+
+    return _analysis->colors_count;
+
+}
+
+// This function converts a band of rows of a streamed image into the row 
+// of (multicolor, if a palette is given) tiles with the same index. Rows 
+// that do not fill a row of tiles are ignored, as for other images.
+
+int convert_streamed_band(unsigned char* _source, int _row_size, int _rows, int _index, void* _context) {
+
+    ImageBands* bands = (ImageBands*)_context;
+    unsigned char* end = _source + bands->width_tiles * (bands->palette != NULL ? 4 : 8) * bands->depth;
+
+    if (_rows < 8) {
+        return 1;
+    }
+
+    if (_row_size > 0) {
+        end += 7 * _row_size;
+    }
+
+    if (bands->palette != NULL) {
+        convert_band_into_multicolor_tiles(_source, end, _row_size, bands->depth, bands->width_tiles, bands->palette, bands->tiles + _index * 8 * bands->width_tiles);
+    } else {
+        convert_band_into_tiles(_source, end, _row_size, bands->depth, bands->width_tiles, bands->threshold, bands->tiles + _index * 8 * bands->width_tiles);
+    }
+
+    return 1;
+
+}
+
+// This function converts a streamed image into (multicolor) tiles, as 
+// convert_image_into_tiles and convert_image_into_multicolor_tiles do, 
+// but a band of rows at a time (and with a single thread). It returns 0 
+// if the image cannot be decoded.
+
+int convert_streamed_image(SharedImage* _image, Configuration* _configuration, ColorAnalysis* _analysis, Output* _output, int _starting_tile) {
+
+    // Luminance threshold, as used by the kernels
+    LuminanceThreshold threshold;
+
+    // Palette, in the same order of the components of the pixels
+    RGB palette[4];
+
+    // Rows of tiles to convert
+    ImageBands bands;
+
+    bands.source = NULL;
+    bands.end = NULL;
+    bands.row_size = _configuration->row_size;
+    bands.depth = _configuration->depth;
+    bands.width_tiles = _configuration->width_tiles;
+    bands.threshold = NULL;
+    bands.palette = NULL;
+    bands.tiles = _output->tiles + (_starting_tile * 8);
+
+    if (_configuration->multicolor) {
+        prepare_kernel_palette(_configuration, _analysis, palette);
+        bands.palette = palette;
+    } else {
+        prepare_luminance_threshold(_configuration, &threshold);
+        bands.threshold = &threshold;
+    }
+
+    return stream_image_bands(_image, convert_streamed_band, &bands);
+
+}
+
+// This function converts the pixels of a decoded image into a luminance 
+// plane, in place: a byte for each pixel, with the luminance calculated 
+// as calculate_luminance does (so the kernels give the same result). Grey
+// pixels are converted with a table.
+
+void convert_into_luminance_plane(SharedImage* _image) {
+
+    unsigned char* plane;
+    unsigned char greys[256];
+    long long i = 0, count = (long long)_image->width * _image->height;
+    RGB grey;
+
+    if (_image->depth < 3) {
+        for (i = 0; i < 256; ++i) {
+            grey.red = grey.green = grey.blue = (int)i;
+            greys[i] = (unsigned char)calculate_luminance(grey);
+        }
+        for (i = 0; i < count; ++i) {
+            _image->pixels[i] = greys[_image->pixels[i * _image->depth]];
+        }
+    } else {
+#ifdef IMG2TILE_X86
+        if (simd_level != SIMD_NONE) {
+            i = convert_pixels_into_luminance_sse2(_image->pixels, _image->depth, count, _image->pixels);
+        }
+#endif
+        for (; i < count; ++i) {
+            _image->pixels[i] = (unsigned char)calculate_pixel_luminance(_image->pixels + i * _image->depth);
+        }
+    }
+
+    plane = realloc(_image->pixels, (size_t)count);
+    if (plane != NULL) {
+        _image->pixels = plane;
+    }
+    _image->luminance = 1;
+    _image->row_size = _image->width;
+
+}
+
+// This function compares two conversion tasks by the name of the image.
+
+int compare_tasks_by_filename(const void* _a, const void* _b) {
+
+    const ConversionTask* a = (const ConversionTask*)_a;
+    const ConversionTask* b = (const ConversionTask*)_b;
+
+    return strcmp(a->job->filename_in[a->index], b->job->filename_in[b->index]);
+
+}
+
+// This function compares two conversion tasks by their position: jobs in 
+// the given order, and images of each job in the given order.
+
+int compare_tasks_by_position(const void* _a, const void* _b) {
+
+    const ConversionTask* a = (const ConversionTask*)_a;
+    const ConversionTask* b = (const ConversionTask*)_b;
+
+    if (a->job != b->job) {
+        return a->job < b->job ? -1 : 1;
+    }
+
+    return a->index - b->index;
+
+}
+
+// This function compares two conversion tasks by the size of their images,
+// in order to sort them from the largest. Tasks with the same image are 
+// kept together, so that the image is freed as soon as possible.
+
+int compare_tasks_by_size(const void* _a, const void* _b) {
+
+    const ConversionTask* a = (const ConversionTask*)_a;
+    const ConversionTask* b = (const ConversionTask*)_b;
+    int image_a = a->job->shared_image[a->index];
+    int image_b = b->job->shared_image[b->index];
+
+    if (a->size != b->size) {
+        return a->size > b->size ? -1 : 1;
+    }
+
+    if (image_a != image_b) {
+        return image_a - image_b;
+    }
+
+    return compare_tasks_by_position(_a, _b);
+
+}
+
+// This function reads the time of last modification and the size of a 
+// file, which tell if a decoded image can be used again. The time has the
+// best resolution given by the system. It returns 0 if it is unable to do
+// so.
+
+int get_file_stamp(char* _filename, long long* _modified, long long* _size) {
+
+    struct stat status;
+
+    if (stat(_filename, &status) != 0) {
+        return 0;
+    }
+
+#if defined(__linux__)
+    *_modified = (long long)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    *_modified = (long long)status.st_mtimespec.tv_sec * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+    *_modified = (long long)status.st_mtime;
+#endif
+    *_size = (long long)status.st_size;
+
+    return 1;
+
+}
+
+// This function frees the decoded images not used by any request, from the
+// least recently used, until their size is below the limit.
+
+void evict_cached_images() {
+
+    int i, oldest;
+
+    while (decode_cache_bytes > decode_cache_limit) {
+        oldest = -1;
+        for (i = 0; i < decode_cache_count; ++i) {
+            if (decode_cache[i].pixels != NULL && decode_cache[i].users == 0 &&
+                (oldest < 0 || decode_cache[i].last_use < decode_cache[oldest].last_use)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            break;
+        }
+        decode_cache_bytes -= decode_cache[oldest].bytes;
+        stbi_image_free(decode_cache[oldest].pixels);
+        free(decode_cache[oldest].filename);
+        decode_cache[oldest].pixels = NULL;
+        decode_cache[oldest].filename = NULL;
+    }
+
+}
+
+// This function looks for an image already decoded by the server, which 
+// has not changed since then (and has its colors, if needed). If found, the
+// image is kept until the request ends, and its index is returned; 
+// otherwise, -1 is returned.
+
+int find_cached_image(SharedImage* _image) {
+
+    int i, found = -1;
+
+    if (!_image->stamped) {
+        return -1;
+    }
+
+    mutex_lock(&decode_cache_mutex);
+
+    for (i = 0; i < decode_cache_count; ++i) {
+        if (decode_cache[i].pixels != NULL && strcmp(decode_cache[i].filename, _image->filename) == 0) {
+            if (decode_cache[i].modified == _image->modified && decode_cache[i].size == _image->size &&
+                (!_image->colors || (!decode_cache[i].luminance && decode_cache[i].depth >= 3))) {
+                ++decode_cache[i].users;
+                decode_cache[i].last_use = ++decode_cache_clock;
+                found = i;
+            }
+            break;
+        }
+    }
+
+    mutex_unlock(&decode_cache_mutex);
+
+    return found;
+
+}
+
+// This function keeps an image just decoded, so that the server can use it
+// again. Previous versions of the same file are freed. The image is kept 
+// under the time of last modification and the size read before the file 
+// was opened: if the file has been saved since then, the image will not be
+// used again. The image is kept until the request ends, and its index is 
+// returned (-1 if the file could not be stamped).
+
+int cache_image(SharedImage* _image) {
+
+    int i, slot = -1;
+
+    if (!_image->stamped) {
+        return -1;
+    }
+
+    mutex_lock(&decode_cache_mutex);
+
+    for (i = 0; i < decode_cache_count; ++i) {
+        if (decode_cache[i].pixels != NULL && decode_cache[i].users == 0 && strcmp(decode_cache[i].filename, _image->filename) == 0) {
+            decode_cache_bytes -= decode_cache[i].bytes;
+            stbi_image_free(decode_cache[i].pixels);
+            free(decode_cache[i].filename);
+            decode_cache[i].pixels = NULL;
+            decode_cache[i].filename = NULL;
+        }
+        if (decode_cache[i].pixels == NULL && slot < 0) {
+            slot = i;
+        }
+    }
+
+    // Slots are never moved, since their indexes are used by the requests.
+    if (slot < 0) {
+        decode_cache = realloc(decode_cache, sizeof(CachedImage) * (decode_cache_count + 1));
+        slot = decode_cache_count++;
+    }
+
+    decode_cache[slot].filename = copy_filename(_image->filename, NULL);
+    decode_cache[slot].modified = _image->modified;
+    decode_cache[slot].size = _image->size;
+    decode_cache[slot].width = _image->width;
+    decode_cache[slot].height = _image->height;
+    decode_cache[slot].depth = _image->depth;
+    decode_cache[slot].pixels = _image->pixels;
+    decode_cache[slot].luminance = _image->luminance;
+    decode_cache[slot].bytes = (long long)_image->height * _image->row_size;
+    decode_cache[slot].users = 1;
+    decode_cache[slot].last_use = ++decode_cache_clock;
+    decode_cache_bytes += decode_cache[slot].bytes;
+
+    mutex_unlock(&decode_cache_mutex);
+
+    return slot;
+
+}
+
+// This function frees the pixels (and the file) of a shared image or, if 
+// the image is kept by the server, tells that this request does not need 
+// it anymore.
+
+void free_shared_image(SharedImage* _image) {
+
+    if (_image->cached >= 0) {
+        mutex_lock(&decode_cache_mutex);
+        --decode_cache[_image->cached].users;
+        evict_cached_images();
+        mutex_unlock(&decode_cache_mutex);
+        _image->cached = -1;
+    } else if (!_image->raw) {
+        stbi_image_free(_image->pixels);
+    }
+
+    unmap_file(&_image->file);
+
+    _image->pixels = NULL;
+
+}
+
+// This function finds the images used by more than one task, so that each
+// image is read only once: tasks are sorted by the name of the image, and 
+// the same shared image is given to the tasks with the same name. Each file
+// is mapped into memory, and the size of each image is read as well (unless
+// the server has already decoded it). The file remains mapped until the 
+// image is decoded (or, for raw and streamed images, until its last use).
+// Huge images are streamed, if they can be read a band at a time. Images
+// used by multicolor jobs are marked, since their colors are needed.
+
+void share_images(ConversionTask* _tasks, int _count, int _argc, char* _argv[]) {
+
+    int i;
+    char* filename;
+    SharedImage* image = NULL;
+    double span;
+
+    qsort(_tasks, _count, sizeof(ConversionTask), compare_tasks_by_filename);
+
+    shared_images = malloc(sizeof(SharedImage) * _count);
+    shared_images_count = 0;
+
+    for (i = 0; i < _count; ++i) {
+        filename = _tasks[i].job->filename_in[_tasks[i].index];
+        if (image == NULL || strcmp(image->filename, filename) != 0) {
+            image = &shared_images[shared_images_count++];
+            image->filename = filename;
+            image->uses = 0;
+            image->colors = 0;
+        }
+        ++image->uses;
+        image->colors |= _tasks[i].job->configuration.multicolor;
+        _tasks[i].job->shared_image[_tasks[i].index] = shared_images_count - 1;
+    }
+
+    for (i = 0; i < shared_images_count; ++i) {
+        image = &shared_images[i];
+        span = start_trace_span();
+        image->pixels = NULL;
+        image->luminance = 0;
+        image->hashed = 0;
+        image->raw = 0;
+        image->streamed = 0;
+        image->bgr = 0;
+        image->file.data = NULL;
+        image->file.size = 0;
+        // The file is stamped before it is opened, so that a file saved 
+        // while it is decoded is never kept with its new stamp.
+        image->stamped = serving && get_file_stamp(image->filename, &image->modified, &image->size);
+        image->cached = find_cached_image(image);
+        if (image->cached >= 0) {
+            image->width = decode_cache[image->cached].width;
+            image->height = decode_cache[image->cached].height;
+            image->depth = decode_cache[image->cached].depth;
+            image->pixels = decode_cache[image->cached].pixels;
+            image->luminance = decode_cache[image->cached].luminance;
+        } else if (!map_file(image->filename, &image->file) || 
+                (!find_raw_pixels(image) &&
+                !stbi_info_from_memory(image->file.data, (int)image->file.size, &image->width, &image->height, &image->depth))) {
+            fprintf(stderr, "ERROR:%s: unable to open file\n", image->filename);
+            usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+        }
+        if (image->cached < 0 && stream_bytes >= 0 && (long long)image->width * image->height * image->depth > stream_bytes) {
+            image->streamed = image->raw || find_png_stream(image);
+        }
+        if (!image->raw) {
+            image->row_size = image->luminance ? image->width : image->width * image->depth;
+        }
+        image->file_size = (long long)image->file.size;
+        end_trace_span("read header", image->filename, span);
+    }
+
+    shared_images_mutex = malloc(sizeof(Mutex) * shared_images_count);
+    for (i = 0; i < shared_images_count; ++i) {
+        mutex_init(&shared_images_mutex[i]);
+    }
+
+}
+
+// This function returns the pixels of a shared image, decoding it if it 
+// is the first time it is needed. If more threads need the same image, 
+// the others wait for the first one to decode it. Raw images are not 
+// decoded (nor kept by the server): their pixels are in the file. Grey 
+// images whose colors are needed are decoded with three components, while
+// images whose colors are not needed are converted into a luminance plane
+// if they are kept after this use (by other jobs, or by the server): it 
+// takes a third of the memory, and it is read faster by the kernels. Grey
+// images are already compared a byte at a time, without converting them.
+
+unsigned char* acquire_shared_image(int _index, int _argc, char* _argv[]) {
+
+    SharedImage* image = &shared_images[_index];
+    int components = image->colors && image->depth < 3 ? 3 : 0;
+    double span;
+
+    mutex_lock(&shared_images_mutex[_index]);
+
+    if (image->pixels == NULL && image->raw) {
+        prefetch_file(&image->file);
+        image->pixels = image->file.data + image->raw_offset;
+    } else if (image->pixels == NULL && image->file.data != NULL) {
+        prefetch_file(&image->file);
+        span = start_trace_span();
+        image->pixels = stbi_load_from_memory(image->file.data, (int)image->file.size, &image->width, &image->height, &image->depth, components);
+        end_trace_span("decode", image->filename, span);
+        if (components != 0) {
+            image->depth = components;
+        }
+        image->row_size = image->width * image->depth;
+        unmap_file(&image->file);
+        if (image->pixels == NULL) {
+            fprintf(stderr, "ERROR:%s: unable to open file\n", image->filename);
+            conversion_error(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+        } else {
+            if (!image->colors && image->depth > 1 && (image->uses > 1 || serving)) {
+                span = start_trace_span();
+                convert_into_luminance_plane(image);
+                end_trace_span("luminance plane", image->filename, span);
+            }
+            if (serving) {
+                image->cached = cache_image(image);
+            }
+        }
+    }
+
+    mutex_unlock(&shared_images_mutex[_index]);
+
+    return image->pixels;
+
+}
+
+// This function tells that a task does not need a shared image anymore: 
+// after its last use, the image is freed (or left to the server).
+
+void release_shared_image(int _index) {
+
+    SharedImage* image = &shared_images[_index];
+
+    mutex_lock(&shared_images_mutex[_index]);
+
+    if (--image->uses == 0) {
+        free_shared_image(image);
+    }
+
+    mutex_unlock(&shared_images_mutex[_index]);
+
+}
+
+// This function continues the calculation of a FNV-1a hash (64 bits) with
+// the given bytes.
+
+unsigned long long hash_bytes(unsigned long long _hash, const void* _data, size_t _size) {
+
+    const unsigned char* data = (const unsigned char*)_data;
+    size_t i;
+
+    for (i = 0; i < _size; ++i) {
+        _hash = (_hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return _hash;
+
+}
+
+// This function calculates the hash of the contents of a file. It returns
+// 0 if it is unable to read the file.
+
+int hash_file(char* _filename, unsigned long long* _hash) {
+
+    MappedFile file;
+
+    if (!map_file(_filename, &file)) {
+        return 0;
+    }
+
+    *_hash = hash_bytes(0xcbf29ce484222325ULL, file.data, file.size);
+
+    unmap_file(&file);
+
+    return 1;
+
+}
+
+// This function calculates the key of the converted image _index of a job
+// into the cache directory: the hash of the contents of the file (read 
+// once, even if used by more jobs), of the options that change the 
+// conversion and of the version of the cache. It returns 0 if it is unable
+// to read the file.
+
+int get_cache_key(Job* _job, int _index, unsigned long long* _key) {
+
+    int shared_image = _job->shared_image[_index];
+    SharedImage* image = &shared_images[shared_image];
+    int options[5];
+
+    mutex_lock(&shared_images_mutex[shared_image]);
+    if (!image->hashed) {
+        // The file is still mapped, unless the image is already decoded.
+        if (image->file.data != NULL) {
+            image->hash = hash_bytes(0xcbf29ce484222325ULL, image->file.data, image->file.size);
+            image->hashed = 1;
+        } else {
+            image->hashed = hash_file(image->filename, &image->hash) ? 1 : -1;
+        }
+    }
+    mutex_unlock(&shared_images_mutex[shared_image]);
+
+    if (image->hashed < 0) {
+        return 0;
+    }
+
+    options[0] = CACHE_VERSION;
+    options[1] = _job->configuration.multicolor;
+    options[2] = _job->configuration.reverse;
+    options[3] = _job->configuration.luminance_threshold;
+    options[4] = _job->configuration.background;
+
+    *_key = hash_bytes(image->hash, options, sizeof(options));
+
+    return 1;
+
+}
+
+// This function returns the name of the file of the cache directory with 
+// the converted image with the given key (to be freed).
+
+char* get_cache_filename(unsigned long long _key) {
+
+    char name[32];
+
+    sprintf(name, "%08x%08x.tiles", (unsigned int)(_key >> 32), (unsigned int)_key);
+
+    return copy_filename(cache_directory, name);
+
+}
+
+// This function reads the converted image _index of a job from the cache
+// directory: the tiles, the size (in tiles) and the colors. It returns 0 
+// if the image is not found (or it is not valid).
+
+int load_cached_tiles(Job* _job, int _index, unsigned long long _key) {
+
+    int header[21], i, found = 0;
+    int tiles_count = _job->width_in_tiles[_index] * _job->height_in_tiles[_index];
+    char* filename = get_cache_filename(_key);
+    FILE* handle = fopen(filename, "rb");
+    ColorAnalysis* analysis = &_job->color_analysis[_index];
+
+    free(filename);
+
+    if (handle == NULL) {
+        return 0;
+    }
+
+    if (fread(header, sizeof(int), 21, handle) == 21 &&
+        header[0] == CACHE_MAGIC && header[1] == CACHE_VERSION &&
+        header[2] == _job->width_in_tiles[_index] && header[3] == _job->height_in_tiles[_index] &&
+        fread(&_job->output.tiles[_job->starting_tile[_index] * 8], 8, tiles_count, handle) == (size_t)tiles_count) {
+        analysis->colors_count = header[4];
+        for (i = 0; i < 4; ++i) {
+            analysis->palette[i].red = header[5 + i * 3];
+            analysis->palette[i].green = header[6 + i * 3];
+            analysis->palette[i].blue = header[7 + i * 3];
+            analysis->nearest_colors[i] = header[17 + i];
+        }
+        found = 1;
+    }
+
+    fclose(handle);
+
+    return found;
+
+}
+
+// This function writes the converted image _index of a job into the cache
+// directory. The file is written with a temporary name and then renamed,
+// so that other programs never read it partially written. Errors are 
+// ignored, since the cache is not needed to convert images.
+
+void store_cached_tiles(Job* _job, int _index, unsigned long long _key) {
+
+    int header[21], i;
+    int tiles_count = _job->width_in_tiles[_index] * _job->height_in_tiles[_index];
+    char* filename = get_cache_filename(_key);
+    char* temporary = malloc(strlen(filename) + 32);
+    ColorAnalysis* analysis = &_job->color_analysis[_index];
+    FILE* handle;
+
+    memset(header, 0, sizeof(header));
+    header[0] = CACHE_MAGIC;
+    header[1] = CACHE_VERSION;
+    header[2] = _job->width_in_tiles[_index];
+    header[3] = _job->height_in_tiles[_index];
+    if (_job->configuration.multicolor) {
+        header[4] = analysis->colors_count;
+        for (i = 0; i < 4; ++i) {
+            header[5 + i * 3] = analysis->palette[i].red;
+            header[6 + i * 3] = analysis->palette[i].green;
+            header[7 + i * 3] = analysis->palette[i].blue;
+            header[17 + i] = analysis->nearest_colors[i];
+        }
+    }
+
+#ifdef _WIN32
+    sprintf(temporary, "%s.%d.%p.tmp", filename, _getpid(), (void*)analysis);
+#else
+    sprintf(temporary, "%s.%d.%p.tmp", filename, (int)getpid(), (void*)analysis);
+#endif
+
+    handle = fopen(temporary, "wb");
+    if (handle != NULL) {
+        int written = fwrite(header, sizeof(int), 21, handle) == 21 &&
+            fwrite(&_job->output.tiles[_job->starting_tile[_index] * 8], 8, tiles_count, handle) == (size_t)tiles_count;
+        if (fclose(handle) == 0 && written) {
+#ifdef _WIN32
+            // On Windows, rename does not replace an existing file.
+            remove(filename);
+#endif
+            if (rename(temporary, filename) != 0) {
+                remove(temporary);
+            }
+        } else {
+            remove(temporary);
+        }
+    }
+
+    free(temporary);
+    free(filename);
+
+}
+
+// This function checks the size of each image of a job, calculates where 
+// its tiles will be put and allocates the tiles. This way the tiles are 
+// allocated just once.
+
+void prepare_job(Job* _job, int _argc, char* _argv[]) {
+
+    int i;
+    int tiles_count = 0;
+    SharedImage* image;
+
+    for (i = 0; i < _job->filename_in_count; ++i) {
+
+        image = &shared_images[_job->shared_image[i]];
+
+        if (_job->configuration.multicolor) {
+            if ((image->width & 0x03) != 0) {
+                fprintf(stderr, "ERROR:%s: cannot convert images with width (%d) not multiple of 4 pixels.\n", image->filename, image->width);
+                usage_and_exit(ERL_CANNOT_CONVERT_WIDTH, _argc, _argv);
+            }
+            _job->width_in_tiles[i] = image->width >> 2;
+        } else {
+            if ((image->width & 0x07) != 0) {
+                fprintf(stderr, "ERROR:%s: cannot convert images with width (%d) not multiple of 8 pixels.\n", image->filename, image->width);
+                usage_and_exit(ERL_CANNOT_CONVERT_WIDTH, _argc, _argv);
+            }
+            _job->width_in_tiles[i] = image->width >> 3;
+        }
+
+        if (_job->configuration.multicolor) {
+            if ((image->height & 0x03) != 0) {
+                fprintf(stderr, "ERROR:%s: cannot convert images with height (%d) not multiple of 8 pixels.\n", image->filename, image->height);
+                usage_and_exit(ERL_CANNOT_CONVERT_HEIGHT, _argc, _argv);
+            }
+            _job->height_in_tiles[i] = image->height >> 3;
+        } else {
+            if ((image->height & 0x07) != 0) {
+                fprintf(stderr, "ERROR:%s: cannot convert images with height (%d) not multiple of 8 pixels.\n", image->filename, image->height);
+                usage_and_exit(ERL_CANNOT_CONVERT_HEIGHT, _argc, _argv);
+            }
+            _job->height_in_tiles[i] = image->height >> 3;
+        }
+
+        _job->starting_tile[i] = tiles_count;
+
+        tiles_count += _job->width_in_tiles[i] * _job->height_in_tiles[i];
+
+    }
+
+    _job->output.tiles_count = tiles_count;
+    _job->output.tiles = malloc(tiles_count * 8);
+    _job->output.map = NULL;
+    _job->output.map_count = 0;
+    _job->output.flips = NULL;
+
+}
+
+// This function writes the output kept for an image being converted, if 
+// verbose (see convert_image), and stops keeping the output of the thread.
+
+void flush_image_output(OutputBuffer* _output) {
+
+    if (!verbose) {
+        return;
+    }
+
+    thread_output = NULL;
+
+    mutex_lock(&output_mutex);
+    fwrite(_output->data, 1, _output->used, stdout);
+    mutex_unlock(&output_mutex);
+
+    free(_output->data);
+
+}
+
+// This function decodes the image of a task and converts it into tiles, 
+// starting from the tile calculated for it. Since each image is written 
+// into its own tiles, many images (of many jobs) can be converted at the 
+// same time. The time taken to find the image into the cache directory 
+// (or to read it) is counted as decoding.
+
+void convert_image(int _index, void* _context) {
+
+    ConversionContext* context = (ConversionContext*)_context;
+    Job* job = context->tasks[_index].job;
+    int index = context->tasks[_index].index;
+    int shared_image = job->shared_image[index];
+
+    // Each image has its own sizes.
+    Configuration image_configuration = job->configuration;
+
+    unsigned char* source;
+    unsigned long long key;
+    int colors_count;
+    int cacheable;
+
+    // Statistics of the image, if needed.
+    Statistics* statistics = NULL;
+    double start = 0;
+
+    // Span of the trace being recorded, if any.
+    double span = start_trace_span();
+
+    // Output of the image, kept until it has been converted (if verbose).
+    OutputBuffer output;
+
+    if (statistics_format != STATISTICS_NONE) {
+        statistics = &job->image_statistics[index];
+        statistics->pixels = (long long)shared_images[shared_image].width * shared_images[shared_image].height;
+        statistics->bytes = shared_images[shared_image].file_size;
+        statistics->tiles = job->width_in_tiles[index] * job->height_in_tiles[index];
+        start = start_phase();
+    }
+
+    cacheable = cache_directory != NULL && get_cache_key(job, index, &key);
+
+    // If the image has been already converted, it is not even decoded.
+    if (cacheable) {
+        if (load_cached_tiles(job, index, key)) {
+            end_trace_span("load cached tiles", job->filename_in[index], span);
+            atomic_fetch_increment(&cache_hits);
+            if (statistics != NULL) {
+                add_phase_time(&statistics->decode, PHASE_DECODE, start);
+                statistics->cached = 1;
+            }
+            if (verbose) {
+                mutex_lock(&output_mutex);
+                printf(" %s: (%dx%d, %d bpp) -> (%dx%d, %d bpp) (cached)\n", job->filename_in[index], shared_images[shared_image].width, shared_images[shared_image].height, shared_images[shared_image].depth, job->width_in_tiles[index], job->height_in_tiles[index], 1+image_configuration.multicolor );
+                mutex_unlock(&output_mutex);
+            }
+            release_shared_image(shared_image);
+            return;
+        }
+        atomic_fetch_increment(&cache_misses);
+        end_trace_span("find cached tiles", job->filename_in[index], span);
+    }
+
+    // Streamed images are read (a band at a time) only while converting.
+    source = NULL;
+    if (!shared_images[shared_image].streamed) {
+        source = acquire_shared_image(shared_image, context->argc, context->argv);
+        if (source == NULL) {
+            return;
+        }
+    }
+
+    if (statistics != NULL) {
+        add_phase_time(&statistics->decode, PHASE_DECODE, start);
+    }
+
+    image_configuration.width = shared_images[shared_image].width;
+    image_configuration.height = shared_images[shared_image].height;
+    image_configuration.depth = shared_images[shared_image].luminance ? 1 : shared_images[shared_image].depth;
+    image_configuration.row_size = shared_images[shared_image].row_size;
+    image_configuration.bgr = shared_images[shared_image].bgr;
+    image_configuration.luminance = shared_images[shared_image].luminance;
+    image_configuration.width_tiles = job->width_in_tiles[index];
+    image_configuration.height_tiles = job->height_in_tiles[index];
+
+    // The output of each image is kept together: it is written at once 
+    // after the conversion, so that images are still converted at the same
+    // time.
+    if (verbose) {
+        output.data = NULL;
+        output.size = 0;
+        output.used = 0;
+        thread_output = &output;
+    }
+
+    if (image_configuration.multicolor) {
+        span = start_trace_span();
+        if (source == NULL) {
+            colors_count = analyze_streamed_image_colors(&shared_images[shared_image], &image_configuration, &job->color_analysis[index], statistics);
+        } else {
+            colors_count = analyze_image_colors(source, &image_configuration, &job->color_analysis[index], statistics);
+        }
+        end_trace_span("extract palette", job->filename_in[index], span);
+        if (colors_count < 0) {
+            flush_image_output(&output);
+            fprintf(stderr, "ERROR:%s: unable to open file\n", job->filename_in[index]);
+            conversion_error(ERL_CANNOT_OPEN_INPUT, context->argc, context->argv);
+            release_shared_image(shared_image);
+            return;
+        } else if (colors_count > 4) {
+            flush_image_output(&output);
+            fprintf(stderr, "ERROR:%s: cannot convert images with more than 4 colors.\n", job->filename_in[index]);
+            conversion_error(ERL_CANNOT_CONVERT_COLORS, context->argc, context->argv);
+            release_shared_image(shared_image);
+            return;
+        }
+    }
+
+    if (verbose) {
+        print_output(" %s: (%dx%d, %d bpp) -> (%dx%d, %d bpp)\n", job->filename_in[index], image_configuration.width, image_configuration.height, shared_images[shared_image].depth, image_configuration.width_tiles, image_configuration.height_tiles, 1+image_configuration.multicolor );
+    }
+
+    // Streamed images are decoded while converting, so the time taken to 
+    // decode them is counted as converting.
+    if (statistics != NULL) {
+        start = start_phase();
+    }
+    span = start_trace_span();
+
+    if (source == NULL) {
+        if (!convert_streamed_image(&shared_images[shared_image], &image_configuration, &job->color_analysis[index], &job->output, job->starting_tile[index])) {
+            flush_image_output(&output);
+            fprintf(stderr, "ERROR:%s: unable to open file\n", job->filename_in[index]);
+            conversion_error(ERL_CANNOT_OPEN_INPUT, context->argc, context->argv);
+            release_shared_image(shared_image);
+            return;
+        }
+    } else if (image_configuration.multicolor) {
+        convert_image_into_multicolor_tiles(source, &image_configuration, &job->color_analysis[index], &job->output, job->starting_tile[index]);
+    } else {
+        convert_image_into_tiles(source, &image_configuration, &job->output, job->starting_tile[index]);
+    }
+
+    if (statistics != NULL) {
+        add_phase_time(&statistics->conversion, PHASE_CONVERSION, start);
+    }
+    end_trace_span("convert", job->filename_in[index], span);
+
+    if (verbose) {
+        thread_output = NULL;
+        mutex_lock(&output_mutex);
+        fwrite(output.data, 1, output.used, stdout);
+        print_tiles_preview(&image_configuration, job->output.tiles + job->starting_tile[index] * 8);
+        mutex_unlock(&output_mutex);
+        free(output.data);
+    }
+
+    if (cacheable) {
+        span = start_trace_span();
+        store_cached_tiles(job, index, key);
+        end_trace_span("store cached tiles", job->filename_in[index], span);
+    }
+
+    release_shared_image(shared_image);
+
+}
+
+// This function returns the name of the temporary file used to write the
+// given file (to be freed): it is unique for each call, even if more jobs
+// write the same file at the same time.
+
+char* get_temporary_filename(char* _filename) {
+
+    char* temporary = malloc(strlen(_filename) + 48);
+    long number = atomic_fetch_increment(&temporary_files);
+
+#ifdef _WIN32
+    sprintf(temporary, "%s.%d.%ld.tmp", _filename, _getpid(), number);
+#else
+    sprintf(temporary, "%s.%d.%ld.tmp", _filename, (int)getpid(), number);
+#endif
+
+    return temporary;
+
+}
+
+// This function returns 1 if the two files have the same contents.
+
+int are_files_equal(char* _a, char* _b) {
+
+    unsigned char buffer_a[65536], buffer_b[65536];
+    size_t size_a, size_b;
+    int equal = 1;
+    FILE* handle_a = fopen(_a, "rb");
+    FILE* handle_b = fopen(_b, "rb");
+
+    if (handle_a == NULL || handle_b == NULL) {
+        equal = 0;
+    }
+
+    while (equal) {
+        size_a = fread(buffer_a, 1, sizeof(buffer_a), handle_a);
+        size_b = fread(buffer_b, 1, sizeof(buffer_b), handle_b);
+        if (size_a != size_b || memcmp(buffer_a, buffer_b, size_a) != 0) {
+            equal = 0;
+        } else if (size_a == 0) {
+            break;
+        }
+    }
+
+    if (handle_a != NULL) {
+        fclose(handle_a);
+    }
+    if (handle_b != NULL) {
+        fclose(handle_b);
+    }
+
+    return equal;
+
+}
+
+// This function replaces a file with the temporary file just written, 
+// unless they have the same contents: in that case the file is not touched
+// at all, so that make (and the like) will not rebuild what depends on it.
+// The file is replaced by a single rename, so it is never seen partially
+// written. It returns 0 if it is unable to do so.
+
+int replace_file(char* _temporary, char* _filename) {
+
+    if (are_files_equal(_temporary, _filename)) {
+        remove(_temporary);
+        return 1;
+    }
+
+#ifdef _WIN32
+    if (!MoveFileExA(_temporary, _filename, MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (rename(_temporary, _filename) != 0) {
+#endif
+        remove(_temporary);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+// This function closes a temporary file just written and, only if it has 
+// been written completely, replaces the given file with it (see 
+// replace_file). Otherwise, the temporary file is removed and the given 
+// file is not touched. It returns what failed ("write" or "replace"), or 
+// NULL if the file has been replaced.
+
+const char* close_temporary_file(FILE* _handle, char* _temporary, char* _filename) {
+
+    int written = !ferror(_handle);
+
+    written = fclose(_handle) == 0 && written;
+
+    if (!written) {
+        remove(_temporary);
+        return "write";
+    }
+
+    if (!replace_file(_temporary, _filename)) {
+        return "replace";
+    }
+
+    return NULL;
+
+}
+
+// This function writes a file name into a dependency file, escaping the 
+// characters with a special meaning for make.
+
+void write_make_filename(FILE* _handle, char* _filename) {
+
+    for (; *_filename; ++_filename) {
+        if (*_filename == ' ' || *_filename == '#') {
+            fputc('\\', _handle);
+        } else if (*_filename == '$') {
+            fputc('$', _handle);
+        }
+        fputc(*_filename, _handle);
+    }
+
+}
+
+// This function writes the dependency file of a job: its outputs depend on
+// all its images, and on the files the images have been read from (lists 
+// of inputs, directories and the manifest), so that changing them rebuilds
+// the outputs as well. Each of them is also a target without dependencies,
+// so that make does not fail when it is removed. It returns what failed 
+// ("open", "write" or "replace"), or NULL if the file has been written.
+
+const char* write_dependencies(Job* _job) {
+
+    int i;
+    char* temporary = get_temporary_filename(_job->filename_depend);
+    FILE* handle = fopen(temporary, "wt");
+    const char* failure;
+
+    if (handle == NULL) {
+        free(temporary);
+        return "open";
+    }
+
+    write_make_filename(handle, _job->filename_out);
+    if (_job->filename_header != NULL) {
+        fputc(' ', handle);
+        write_make_filename(handle, _job->filename_header);
+    }
+    fputc(':', handle);
+    for (i = 0; i < _job->filename_in_count; ++i) {
+        fputs(" \\\n ", handle);
+        write_make_filename(handle, _job->filename_in[i]);
+    }
+    for (i = 0; i < _job->filename_source_count; ++i) {
+        fputs(" \\\n ", handle);
+        write_make_filename(handle, _job->filename_source[i]);
+    }
+    fputc('\n', handle);
+    for (i = 0; i < _job->filename_in_count; ++i) {
+        fputc('\n', handle);
+        write_make_filename(handle, _job->filename_in[i]);
+        fputs(":\n", handle);
+    }
+    for (i = 0; i < _job->filename_source_count; ++i) {
+        fputc('\n', handle);
+        write_make_filename(handle, _job->filename_source[i]);
+        fputs(":\n", handle);
+    }
+
+    failure = close_temporary_file(handle, temporary, _job->filename_depend);
+
+    free(temporary);
+
+    return failure;
+
+}
+
+// This function removes the duplicated tiles of a job (if requested) and
+// writes its tiles, C header and dependency file (only if changed). Since 
+// each job has its own files, many jobs can be finished at the same time.
+
+void finish_job(int _index, void* _context) {
+
+    ConversionContext* context = (ConversionContext*)_context;
+    Job* job = &context->jobs[_index];
+    int i;
+    double start = 0;
+    double span = start_trace_span();
+    const char* failure;
+
+    // The output of each job is kept together.
+    if (verbose) {
+        mutex_lock(&output_mutex);
+    }
+
+    // Removing duplicated tiles is counted as writing the tiles, and 
+    // writing the dependency file as writing the header.
+    if (statistics_format != STATISTICS_NONE) {
+        start = start_phase();
+    }
+
+    if (job->deduplicate != DEDUPLICATE_NONE) {
+        deduplicate_tiles(&job->output, job->deduplicate, job->configuration.multicolor);
+        end_trace_span("remove duplicated tiles", job->filename_out, span);
+        span = start_trace_span();
+    }
+
+    char* temporary = get_temporary_filename(job->filename_out);
+    FILE *handle = fopen(temporary, "w+b");
+    if (handle == NULL) {
+        failure = "open";
+    } else {
+        fwrite(job->output.tiles, 8, job->output.tiles_count, handle);
+        failure = close_temporary_file(handle, temporary, job->filename_out);
+    }
+    if (failure != NULL) {
+        fprintf(stderr, "ERROR:: unable to %s output file '%s'.\n", failure, job->filename_out);
+        conversion_error(ERL_CANNOT_OPEN_OUTPUT, context->argc, context->argv);
+        if (verbose) {
+            mutex_unlock(&output_mutex);
+        }
+        free(temporary);
+        return;
+    }
+    free(temporary);
+
+    if (statistics_format != STATISTICS_NONE) {
+        start = add_phase_time(&job->statistics.output, PHASE_OUTPUT, start);
+        job->statistics.tiles = job->output.tiles_count;
+    }
+    end_trace_span("write tiles", job->filename_out, span);
+
+    if (job->filename_header != NULL) {
+        unsigned char buffer[80];
+        span = start_trace_span();
+        sprintf(buffer, "%d", 0);
+        temporary = get_temporary_filename(job->filename_header);
+        handle = fopen(temporary, "w+t");
+        if (handle == NULL) {
+            fprintf(stderr, "ERROR:: unable to open header file %s\n", job->filename_header);
+            conversion_error(ERL_CANNOT_OPEN_HEADER, context->argc, context->argv);
+            if (verbose) {
+                mutex_unlock(&output_mutex);
+            }
+            free(temporary);
+            return;
+        }
+        if (job->configuration.bank > 0) {
+            fprintf(handle, "#ifndef _TILES%d_\n", job->configuration.bank);
+            fprintf(handle, "\n\t#define TILE%d_START%*s\n", job->configuration.bank, 35, buffer);
+        }
+        else {
+            fprintf(handle, "#ifndef _TILES_\n");
+            fprintf(handle, "\n\t#define TILE_START%*s\n", 35, buffer);
+        }
+        if (job->configuration.multicolor) {
+            for (i = 0; i < 4; ++i) {
+                if (job->configuration.bank > 0) {
+                    fprintf(handle, "\n\t#define TILE%d_COLOR%d%*sMR_COLOR_%s", job->configuration.bank, i, 33, " ", COLORS[job->color_analysis[job->filename_in_count - 1].nearest_colors[i]].name);
+                } else {
+                    fprintf(handle, "\n\t#define TILE_COLOR%d%*sMR_COLOR_%s", i, 33, " ", COLORS[job->color_analysis[job->filename_in_count - 1].nearest_colors[i]].name);
+                }
+            }
+        }
+        fprintf(handle, "\n");
+        for (i = 0; i < job->filename_in_count; ++i) {
+            unsigned char* tilename = copy_filename(basename(job->filename_in[i]), NULL);
+            unsigned char* sep = strrchr(tilename, '_');
+            unsigned char* dot = strchr(tilename, '.');
+            if (dot != NULL) *dot = 0;
+            if (sep == NULL) sep = tilename;
+            ++sep;
+            sep = strupr(sep);
+            sprintf(buffer, "%d", job->starting_tile[i]);
+            if (job->configuration.bank > 0) {
+                fprintf(handle, "\n\t#define TILE%d_%s%*s\n", job->configuration.bank, sep, (40 - strlen(sep)), buffer);
+            } else {
+                fprintf(handle, "\n\t#define TILE_%s%*s\n", sep, (40 - strlen(sep)), buffer);
+            }
+            sprintf(buffer, "%d", job->width_in_tiles[i]);
+            if (job->configuration.bank > 0) {
+                fprintf(handle, "\t#define TILE%d_%s_WIDTH%*s\n", job->configuration.bank, sep, (34 - strlen(sep)), buffer);
+            } else {
+                fprintf(handle, "\t#define TILE_%s_WIDTH%*s\n", sep, (34 - strlen(sep)), buffer);
+            }
+            sprintf(buffer, "%d", job->height_in_tiles[i]);
+            if (job->configuration.bank > 0) {
+                fprintf(handle, "\t#define TILE%d_%s_HEIGHT%*s\n", job->configuration.bank, sep, (33 - strlen(sep)), buffer);
+            } else {
+                fprintf(handle, "\t#define TILE_%s_HEIGHT%*s\n", sep, (33 - strlen(sep)), buffer);
+            }
+            free(tilename);
+        }
+        if (job->output.map != NULL) {
+            // Images are described by the tile map: TILE_name is the index 
+            // of the first cell of the image into the map.
+            if (job->configuration.bank > 0) {
+                fprintf(handle, "\n\tstatic const %s TILE%d_MAP[] = {", job->output.tiles_count > 256 ? "unsigned short" : "unsigned char", job->configuration.bank);
+            } else {
+                fprintf(handle, "\n\tstatic const %s TILE_MAP[] = {", job->output.tiles_count > 256 ? "unsigned short" : "unsigned char");
+            }
+            for (i = 0; i < job->output.map_count; ++i) {
+                fprintf(handle, "%s%d", (i == 0) ? "\n\t\t" : ((i % 16) == 0 ? ",\n\t\t" : ", "), job->output.map[i]);
+            }
+            fprintf(handle, "\n\t};\n");
+        }
+        if (job->output.flips != NULL) {
+            // Flip flags for each cell: 1 = mirrored horizontally, 
+            // 2 = flipped vertically.
+            if (job->configuration.bank > 0) {
+                fprintf(handle, "\n\tstatic const unsigned char TILE%d_FLIPS[] = {", job->configuration.bank);
+            } else {
+                fprintf(handle, "\n\tstatic const unsigned char TILE_FLIPS[] = {");
+            }
+            for (i = 0; i < job->output.map_count; ++i) {
+                fprintf(handle, "%s%d", (i == 0) ? "\n\t\t" : ((i % 16) == 0 ? ",\n\t\t" : ", "), job->output.flips[i]);
+            }
+            fprintf(handle, "\n\t};\n");
+        }
+        sprintf(buffer, "%d", job->output.tiles_count);
+        if (job->configuration.bank > 0) {
+            fprintf(handle, "\n\t#define TILE%d_COUNT%*s\n", job->configuration.bank, 36, buffer);
+        } else {
+            fprintf(handle, "\n\t#define TILE_COUNT%*s\n", 36, buffer);
+        }
+        fprintf(handle, "#endif\n");
+        failure = close_temporary_file(handle, temporary, job->filename_header);
+        if (failure != NULL) {
+            fprintf(stderr, "ERROR:: unable to %s header file %s\n", failure, job->filename_header);
+            conversion_error(ERL_CANNOT_OPEN_HEADER, context->argc, context->argv);
+            if (verbose) {
+                mutex_unlock(&output_mutex);
+            }
+            free(temporary);
+            return;
+        }
+        free(temporary);
+        end_trace_span("write header", job->filename_header, span);
+    }
+
+    span = start_trace_span();
+    failure = job->filename_depend != NULL ? write_dependencies(job) : NULL;
+    if (failure != NULL) {
+        fprintf(stderr, "ERROR:: unable to %s dependency file %s\n", failure, job->filename_depend);
+        conversion_error(ERL_CANNOT_OPEN_OUTPUT, context->argc, context->argv);
+        if (verbose) {
+            mutex_unlock(&output_mutex);
+        }
+        return;
+    }
+
+    if (statistics_format != STATISTICS_NONE) {
+        add_phase_time(&job->statistics.header, PHASE_HEADER, start);
+    }
+    if (job->filename_depend != NULL) {
+        end_trace_span("write dependencies", job->filename_depend, span);
+    }
+
+    if (verbose) {
+        printf("Wrote a total of %d tiles.\n\n", job->output.tiles_count);
+    }
+
+    if (verbose) {
+        mutex_unlock(&output_mutex);
+    }
+
+    free(job->output.tiles);
+    free(job->output.map);
+    free(job->output.flips);
+    job->output.tiles = NULL;
+    job->output.map = NULL;
+    job->output.flips = NULL;
+
+}
+
+// This function frees the inputs, the outputs and the tables of a job.
+
+void free_job(Job* _job) {
+
+    int i;
+
+    for (i = 0; i < _job->filename_in_count; ++i) {
+        free(_job->filename_in[i]);
+    }
+    free(_job->filename_in);
+    for (i = 0; i < _job->filename_source_count; ++i) {
+        free(_job->filename_source[i]);
+    }
+    free(_job->filename_source);
+    free(_job->shared_image);
+    free(_job->starting_tile);
+    free(_job->width_in_tiles);
+    free(_job->height_in_tiles);
+    free(_job->color_analysis);
+    free(_job->image_statistics);
+    free(_job->filename_out);
+    free(_job->filename_header);
+    free(_job->filename_depend);
+    free(_job->output.tiles);
+    free(_job->output.map);
+    free(_job->output.flips);
+
+    init_job(_job, _job);
+
+}
+
+// This function frees all the jobs, their tasks and the images used by 
+// them, so that other jobs can be executed by the same process.
+
+void free_jobs() {
+
+    int i;
+
+    for (i = 0; i < jobs_count; ++i) {
+        free_job(&jobs_list[i]);
+    }
+    free(jobs_list);
+    jobs_list = NULL;
+    jobs_count = 0;
+
+    for (i = 0; i < shared_images_count; ++i) {
+        free_shared_image(&shared_images[i]);
+        if (shared_images_mutex != NULL) {
+            mutex_destroy(&shared_images_mutex[i]);
+        }
+    }
+    free(shared_images);
+    free(shared_images_mutex);
+    shared_images = NULL;
+    shared_images_mutex = NULL;
+    shared_images_count = 0;
+
+    free(conversion_tasks);
+    conversion_tasks = NULL;
+
+}
+
+// This function writes a string as a JSON string (between double quotes).
+
+void write_json_string(FILE* _handle, char* _string) {
+
+    unsigned char* c;
+
+    fputc('"', _handle);
+    for (c = (unsigned char*)_string; *c != 0; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(_handle, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(_handle, "\\u%04x", *c);
+        } else {
+            fputc(*c, _handle);
+        }
+    }
+    fputc('"', _handle);
+
+}
+
+// This function returns how many millions of pixels have been converted 
+// each second (0 if no time has been taken).
+
+double calculate_throughput(long long _pixels, double _time) {
+
+    return _time > 0 ? _pixels / _time / 1000000 : 0;
+
+}
+
+// This function shows the events counted during each phase by the 
+// performance counters (see --perf-counters), as text or as a member of 
+// the JSON document of the statistics: cycles and instructions (and how
+// many instructions for each cycle), cache misses and branch misses (and 
+// how many for each tile), or why they could not be counted.
+
+void print_perf_counters(long long _pixels, long long _tiles) {
+
+    static const char* names[PERF_COUNTERS_COUNT] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+    int i, phase;
+    long long* events;
+
+    if (!perf_available[PERF_CYCLES]) {
+#ifdef IMG2TILE_PERF
+        const char* reason = perf_error != 0 ? strerror(perf_error) : "no event counted";
+#else
+        const char* reason = "not supported on this platform";
+#endif
+        if (statistics_format == STATISTICS_JSON) {
+            printf(",\n  \"perf_counters\": {\n    \"available\": false,\n    \"reason\": ");
+            write_json_string(stdout, (char*)reason);
+            printf("\n  }");
+        } else {
+            printf("Performance counters ........ not available (%s)\n", reason);
+        }
+        return;
+    }
+
+    if (statistics_format == STATISTICS_JSON) {
+        printf(",\n  \"perf_counters\": {\n    \"available\": true");
+    } else {
+        printf("Performance counters ........ IPC, cycles/pixel, cache misses/tile, branch misses/tile\n");
+    }
+
+    for (phase = 0; phase < PHASES_COUNT; ++phase) {
+        events = (long long*)perf_events[phase];
+        if (statistics_format == STATISTICS_JSON) {
+            printf(",\n    \"%s\": {", PHASE_NAMES[phase]);
+            for (i = 0; i < PERF_COUNTERS_COUNT; ++i) {
+                if (perf_available[i]) {
+                    printf("\n      \"%s\": %lld,", names[i], events[i]);
+                } else {
+                    printf("\n      \"%s\": null,", names[i]);
+                }
+            }
+            printf("\n      \"instructions_per_cycle\": %.3f,", events[PERF_CYCLES] > 0 ? (double)events[PERF_INSTRUCTIONS] / events[PERF_CYCLES] : 0);
+            printf("\n      \"cycles_per_pixel\": %.3f,", _pixels > 0 ? (double)events[PERF_CYCLES] / _pixels : 0);
+            printf("\n      \"cache_misses_per_tile\": %.3f,", _tiles > 0 ? (double)events[PERF_CACHE_MISSES] / _tiles : 0);
+            printf("\n      \"branch_misses_per_tile\": %.3f\n    }", _tiles > 0 ? (double)events[PERF_BRANCH_MISSES] / _tiles : 0);
+        } else {
+            printf(" %-12s %8.3f %10.3f %10.3f %10.3f\n", PHASE_NAMES[phase],
+                events[PERF_CYCLES] > 0 ? (double)events[PERF_INSTRUCTIONS] / events[PERF_CYCLES] : 0,
+                _pixels > 0 ? (double)events[PERF_CYCLES] / _pixels : 0,
+                _tiles > 0 ? (double)events[PERF_CACHE_MISSES] / _tiles : 0,
+                _tiles > 0 ? (double)events[PERF_BRANCH_MISSES] / _tiles : 0);
+        }
+    }
+
+    if (statistics_format == STATISTICS_JSON) {
+        printf("\n  }");
+    } else {
+        for (i = PERF_INSTRUCTIONS; i < PERF_COUNTERS_COUNT; ++i) {
+            if (!perf_available[i]) {
+                printf(" (%s not available)\n", names[i]);
+            }
+        }
+    }
+
+}
+
+// This function shows the statistics of the jobs executed (see --stats), 
+// as text or as a JSON document: for each image, the time taken by each 
+// phase (in milliseconds) and how much has been converted; for each job, 
+// the time taken to write its files; and the totals, with the time 
+// elapsed since the jobs started (each file is read once). When images are converted in parallel,
+// the times of the images are larger than the time elapsed.
+
+void print_statistics(double _elapsed) {
+
+    int i, j;
+    long long pixels = 0, bytes = 0, tiles = 0, converted_tiles = 0;
+    int images = 0;
+    Job* job;
+    Statistics* statistics;
+    double time;
+
+    if (statistics_format == STATISTICS_JSON) {
+        printf("{\n  \"jobs\": [");
+    }
+
+    for (j = 0; j < jobs_count; ++j) {
+        job = &jobs_list[j];
+        if (statistics_format == STATISTICS_JSON) {
+            printf("%s\n    {\n      \"output\": ", j == 0 ? "" : ",");
+            write_json_string(stdout, job->filename_out);
+            printf(",\n      \"tiles\": %d,\n      \"output_ms\": %.3f,\n      \"header_ms\": %.3f,\n      \"images\": [", job->statistics.tiles, job->statistics.output * 1000, job->statistics.header * 1000);
+        }
+        for (i = 0; i < job->filename_in_count; ++i) {
+            statistics = &job->image_statistics[i];
+            time = statistics->decode + statistics->palette + statistics->matching + statistics->conversion;
+            if (statistics_format == STATISTICS_JSON) {
+                printf("%s\n        {\n          \"input\": ", i == 0 ? "" : ",");
+                write_json_string(stdout, job->filename_in[i]);
+                printf(",\n          \"pixels\": %lld,\n          \"bytes\": %lld,\n          \"tiles\": %d,\n          \"cached\": %s,\n", statistics->pixels, statistics->bytes, statistics->tiles, statistics->cached ? "true" : "false");
+                printf("          \"decode_ms\": %.3f,\n          \"palette_ms\": %.3f,\n          \"matching_ms\": %.3f,\n          \"conversion_ms\": %.3f,\n", statistics->decode * 1000, statistics->palette * 1000, statistics->matching * 1000, statistics->conversion * 1000);
+                printf("          \"megapixels_per_second\": %.3f\n        }", calculate_throughput(statistics->pixels, time));
+            } else {
+                printf(" %s: %lld pixels, %lld bytes, %d tiles%s\n", job->filename_in[i], statistics->pixels, statistics->bytes, statistics->tiles, statistics->cached ? " (cached)" : "");
+                printf("   decode %.3f ms, palette %.3f ms, matching %.3f ms, conversion %.3f ms (%.1f Mpixels/s)\n", statistics->decode * 1000, statistics->palette * 1000, statistics->matching * 1000, statistics->conversion * 1000, calculate_throughput(statistics->pixels, time));
+            }
+            pixels += statistics->pixels;
+            converted_tiles += statistics->tiles;
+            ++images;
+        }
+        if (statistics_format == STATISTICS_JSON) {
+            printf("\n      ]\n    }");
+        } else {
+            printf(" %s: %d tiles\n", job->filename_out, job->statistics.tiles);
+            printf("   output %.3f ms, header %.3f ms\n", job->statistics.output * 1000, job->statistics.header * 1000);
+        }
+        tiles += job->statistics.tiles;
+    }
+
+    // Images used by more jobs are read only once.
+    for (i = 0; i < shared_images_count; ++i) {
+        bytes += shared_images[i].file_size;
+    }
+
+    if (statistics_format == STATISTICS_JSON) {
+        printf("\n  ],\n  \"images\": %d,\n  \"pixels\": %lld,\n  \"bytes\": %lld,\n  \"tiles\": %lld,\n", images, pixels, bytes, tiles);
+        printf("  \"elapsed_ms\": %.3f,\n  \"megapixels_per_second\": %.3f,\n  \"images_per_second\": %.3f,\n  \"peak_memory_kb\": %lld", _elapsed * 1000, calculate_throughput(pixels, _elapsed), _elapsed > 0 ? images / _elapsed : 0, get_peak_memory());
+        if (perf_counters) {
+            print_perf_counters(pixels, converted_tiles);
+        }
+        printf("\n}\n");
+    } else {
+        printf("Converted ................... %d images, %lld pixels, %lld bytes read, %lld tiles\n", images, pixels, bytes, tiles);
+        printf("Elapsed time ................ %.3f ms (%.1f Mpixels/s, %.1f images/s)\n", _elapsed * 1000, calculate_throughput(pixels, _elapsed), _elapsed > 0 ? images / _elapsed : 0);
+        printf("Peak memory ................. %lld KB\n", get_peak_memory());
+        if (perf_counters) {
+            print_perf_counters(pixels, converted_tiles);
+        }
+    }
+
+}
+
+// This function writes the trace of the execution (see --trace) into the 
+// given file, as a JSON document in the trace event format (that can be 
+// opened by trace viewers): a complete event for each span, with when it
+// started and how long it took (in microseconds), the thread that recorded
+// it and the file it was about. The spans are then freed.
+
+void write_trace(char* _filename, int _argc, char* _argv[]) {
+
+    TraceBuffer* buffer;
+    TraceEvent* event;
+    int i, first = 1;
+    FILE* handle = fopen(_filename, "wt");
+
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR:: unable to open trace file %s\n", _filename);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+
+    fprintf(handle, "{\"traceEvents\":[");
+    for (buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        for (i = 0; i < buffer->count; ++i) {
+            event = &buffer->events[i];
+            fprintf(handle, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", first ? "" : ",", event->name, buffer->thread, event->start * 1000000, event->duration * 1000000);
+            if (event->filename != NULL) {
+                fprintf(handle, ",\"args\":{\"file\":");
+                write_json_string(handle, event->filename);
+                fprintf(handle, "}");
+            }
+            fprintf(handle, "}");
+            first = 0;
+        }
+    }
+    fprintf(handle, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(handle);
+
+    free_trace();
+
+}
+
+// This function compares the hash of each file written by the jobs (tiles
+// and C header) with the one into the given file (see --golden), a line 
+// for each file with its hash and its name. If the file does not exist, it
+// is written with the hashes of the files just written. Each file that 
+// differs (or is missing) is reported, and then the program exits.
+
+void check_golden_hashes(char* _filename, int _argc, char* _argv[]) {
+
+    char line[4096];
+    char* name;
+    char* end;
+    unsigned long long hash, expected;
+    int i, j, found, different = 0, checked = 0;
+    FILE* handle = fopen(_filename, "rt");
+
+    if (handle == NULL) {
+        handle = fopen(_filename, "wt");
+        if (handle == NULL) {
+            fprintf(stderr, "ERROR:%s: unable to open golden file\n", _filename);
+            usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+        }
+        for (j = 0; j < jobs_count; ++j) {
+            for (i = 0; i < 2; ++i) {
+                name = i == 0 ? jobs_list[j].filename_out : jobs_list[j].filename_header;
+                if (name != NULL && hash_file(name, &hash)) {
+                    fprintf(handle, "%016llx %s\n", hash, name);
+                }
+            }
+        }
+        fclose(handle);
+        if (verbose) {
+            printf("Golden hashes ............... written into %s\n", _filename);
+        }
+        return;
+    }
+
+    for (j = 0; j < jobs_count; ++j) {
+        for (i = 0; i < 2; ++i) {
+            name = i == 0 ? jobs_list[j].filename_out : jobs_list[j].filename_header;
+            if (name == NULL) {
+                continue;
+            }
+            found = 0;
+            rewind(handle);
+            while (!found && fgets(line, sizeof(line), handle) != NULL) {
+                end = line + strlen(line);
+                while (end > line && (end[-1] == '\n' || end[-1] == '\r')) {
+                    *--end = 0;
+                }
+                if (strlen(line) > 17 && line[16] == ' ' && strcmp(line + 17, name) == 0) {
+                    expected = strtoull(line, NULL, 16);
+                    found = 1;
+                }
+            }
+            if (!found || !hash_file(name, &hash) || hash != expected) {
+                fprintf(stderr, "ERROR:%s: %s\n", name, found ? "different from the golden hash" : "missing golden hash");
+                ++different;
+            }
+            ++checked;
+        }
+    }
+
+    fclose(handle);
+
+    if (different > 0) {
+        usage_and_exit(ERL_GOLDEN_MISMATCH, _argc, _argv);
+    }
+
+    if (verbose) {
+        printf("Golden hashes ............... %d files checked\n", checked);
+    }
+
+}
+
+// This function executes the job given by the command line (if it has 
+// inputs or outputs) and the jobs of the manifest (if any). Any error 
+// exits the program (or abandons the request being served).
+
+void run_jobs(Job* _command_line, int _argc, char* _argv[]) {
+
+    int i = 0, j;
+
+    ConversionContext context;
+    int tasks_count = 0;
+    double start = statistics_format != STATISTICS_NONE ? get_monotonic_time() : 0;
+
+    if (perf_counters) {
+        memset((void*)perf_events, 0, sizeof(perf_events));
+    }
+
+    if (jobs <= 0) {
+        jobs = count_processors();
+    }
+
+    cache_hits = 0;
+    cache_misses = 0;
+
+    // The command line is a job by itself, unless it gives only the 
+    // default options for the jobs of the manifest.
+    if (filename_manifest == NULL || _command_line->filename_in_count > 0 || _command_line->filename_out != NULL) {
+
+        if (_command_line->filename_in_count == 0 ) {
+            fprintf(stderr, "ERROR:: missing input filename.\n");
+            usage_and_exit(ERL_MISSING_INPUT_FILENAME, _argc, _argv);
+        }
+
+        if (_command_line->filename_out == NULL) {
+            fprintf(stderr, "ERROR:: missing output filename for luminance.\n");
+            usage_and_exit(ERL_MISSING_OUTPUT_FILENAME, _argc, _argv);
+        }
+
+        // The inputs and the outputs now belong to the new job.
+        *add_job(NULL) = *_command_line;
+        init_job(_command_line, _command_line);
+
+    }
+
+    if (filename_manifest != NULL) {
+        read_manifest(filename_manifest, _command_line, _argc, _argv);
+    }
+
+    if (jobs_count == 0) {
+        fprintf(stderr, "ERROR:%s: no jobs into the manifest.\n", filename_manifest);
+        usage_and_exit(ERL_MISSING_INPUT_FILENAME, _argc, _argv);
+    }
+
+    if (cache_directory != NULL && !create_directory(cache_directory)) {
+        fprintf(stderr, "ERROR:%s: unable to create directory\n", cache_directory);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+
+    if (filename_trace != NULL) {
+        start_trace();
+    }
+
+    for (j = 0; j < jobs_count; ++j) {
+        Job* job = &jobs_list[j];
+        if (verbose) {
+            for (i = 0; i < job->filename_in_count; ++i) {
+                printf("Input image ................. %s\n", job->filename_in[i]);
+            }
+            printf("Output tile(s) .............. %s\n", job->filename_out);
+        }
+        job->shared_image = malloc(sizeof(int) * job->filename_in_count);
+        job->starting_tile = malloc(sizeof(int) * job->filename_in_count);
+        job->width_in_tiles = malloc(sizeof(int) * job->filename_in_count);
+        job->height_in_tiles = malloc(sizeof(int) * job->filename_in_count);
+        job->color_analysis = malloc(sizeof(ColorAnalysis) * job->filename_in_count);
+        if (statistics_format != STATISTICS_NONE) {
+            job->image_statistics = calloc(job->filename_in_count, sizeof(Statistics));
+        }
+        tasks_count += job->filename_in_count;
+    }
+
+    // Each image of each job is a task: all of them are converted together,
+    // so that independent jobs are executed in parallel.
+    conversion_tasks = malloc(sizeof(ConversionTask) * tasks_count);
+    tasks_count = 0;
+    for (j = 0; j < jobs_count; ++j) {
+        for (i = 0; i < jobs_list[j].filename_in_count; ++i) {
+            conversion_tasks[tasks_count].job = &jobs_list[j];
+            conversion_tasks[tasks_count].index = i;
+            ++tasks_count;
+        }
+    }
+
+    // Read only the size of each image (once, even if used by more jobs), 
+    // to check it and to calculate where its tiles will be put.
+    share_images(conversion_tasks, tasks_count, _argc, _argv);
+
+    for (j = 0; j < jobs_count; ++j) {
+        prepare_job(&jobs_list[j], _argc, _argv);
+    }
+
+    for (i = 0; i < tasks_count; ++i) {
+        conversion_tasks[i].size = conversion_tasks[i].job->width_in_tiles[conversion_tasks[i].index] * conversion_tasks[i].job->height_in_tiles[conversion_tasks[i].index];
+    }
+
+    // Larger images are converted first, so that the last ones are small
+    // and the threads finish at about the same time.
+    if (jobs > 1) {
+        qsort(conversion_tasks, tasks_count, sizeof(ConversionTask), compare_tasks_by_size);
+    } else {
+        qsort(conversion_tasks, tasks_count, sizeof(ConversionTask), compare_tasks_by_position);
+    }
+
+    // Threads not needed to convert different images at the same time 
+    // are used to convert the rows of tiles of large images.
+    band_jobs = tasks_count > 0 && tasks_count < jobs ? jobs / tasks_count : 1;
+
+    // Events are counted by each thread: so, when counted, each image is 
+    // converted by a single thread.
+    if (perf_counters) {
+        band_jobs = 1;
+    }
+
+    context.tasks = conversion_tasks;
+    context.jobs = jobs_list;
+    context.argc = _argc;
+    context.argv = _argv;
+
+    run_in_parallel(jobs, tasks_count, NULL, convert_image, &context);
+
+    if (request_error) {
+        usage_and_exit(request_error, _argc, _argv);
+    }
+
+    run_in_parallel(jobs, jobs_count, NULL, finish_job, &context);
+
+    if (request_error) {
+        usage_and_exit(request_error, _argc, _argv);
+    }
+
+    if (verbose && cache_directory != NULL) {
+        printf("Tile cache .................. %ld hits, %ld misses\n", cache_hits, cache_misses);
+    }
+
+    if (statistics_format != STATISTICS_NONE) {
+        print_statistics(get_monotonic_time() - start);
+    }
+
+    if (filename_trace != NULL) {
+        write_trace(filename_trace, _argc, _argv);
+    }
+
+    if (filename_golden != NULL) {
+        check_golden_hashes(filename_golden, _argc, _argv);
+    }
+
+    free_jobs();
+
+}
+
+// This function serves a request: it reads a line with the options (as 
+// for the command line), executes the job(s) and sends back everything 
+// written by the program, followed by a last line with the error level 
+// ("EXIT <level>"). The options given to the server are used as defaults.
+
+void serve_request(int _client, Job* _defaults, char* _program) {
+
+#ifndef _WIN32
+    char* line = NULL;
+    int length = 0, size = 0, received;
+    char** arguments;
+    int count, level;
+    int saved_output, saved_error;
+    int saved_verbose = verbose, saved_debug = debug, saved_jobs = jobs, saved_parallel_pixels = parallel_pixels;
+    int saved_statistics_format = statistics_format, saved_preview_columns = preview_columns;
+    char* saved_filename_trace = filename_trace;
+    char* saved_filename_golden = filename_golden;
+    int saved_perf_counters = perf_counters;
+    char* saved_cache_directory = cache_directory;
+    long long saved_stream_bytes = stream_bytes, saved_decode_cache_limit = decode_cache_limit;
+    jmp_buf abandon;
+    Job job;
+
+    do {
+        if (length + 1 >= size) {
+            size = size ? size * 2 : 4096;
+            line = realloc(line, size);
+        }
+        received = (int)recv(_client, line + length, size - length - 1, 0);
+        if (received > 0) {
+            length += received;
+        }
+        line[length] = 0;
+    } while (received > 0 && strchr(line, '\n') == NULL);
+
+    // The output of the program (and its errors) is sent to the client.
+    fflush(stdout);
+    fflush(stderr);
+    saved_output = dup(1);
+    saved_error = dup(2);
+    dup2(_client, 1);
+    dup2(_client, 2);
+
+    count = split_manifest_line(line, _program, &arguments);
+    free(line);
+    init_job(&job, _defaults);
+    filename_manifest = NULL;
+    request_error = 0;
+
+    if ((level = setjmp(abandon)) == 0) {
+        request_abort = &abandon;
+        parse_options(count, arguments, &job, OPTIONS_REQUEST);
+        run_jobs(&job, count, arguments);
+    }
+
+    request_abort = NULL;
+    free_jobs();
+    free_job(&job);
+    free_arguments(count, arguments);
+
+    printf("EXIT %d\n", level);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_output, 1);
+    dup2(saved_error, 2);
+    close(saved_output);
+    close(saved_error);
+
+    verbose = saved_verbose;
+    debug = saved_debug;
+    jobs = saved_jobs;
+    parallel_pixels = saved_parallel_pixels;
+    cache_directory = saved_cache_directory;
+    statistics_format = saved_statistics_format;
+    filename_trace = saved_filename_trace;
+    filename_golden = saved_filename_golden;
+    perf_counters = saved_perf_counters;
+    stream_bytes = saved_stream_bytes;
+    decode_cache_limit = saved_decode_cache_limit;
+    preview_columns = saved_preview_columns;
+
+    // Images kept over the limit of the server (given by this request).
+    mutex_lock(&decode_cache_mutex);
+    evict_cached_images();
+    mutex_unlock(&decode_cache_mutex);
+#endif
+
+}
+
+// This function keeps the program resident, serving one request at a 
+// time from a Unix domain socket. Images are decoded only once, as long 
+// as they do not change: the server keeps them, up to the size given by
+// '--cache'.
+
+void serve_requests(char* _socket, Job* _defaults, int _argc, char* _argv[]) {
+
+#ifdef _WIN32
+    fprintf(stderr, "ERROR:: serving requests is not supported on this platform.\n");
+    usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+#else
+    struct sockaddr_un address;
+    int server, client;
+
+    if (strlen(_socket) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR:%s: socket name too long.\n", _socket);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, _socket);
+
+    unlink(_socket);
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+        fprintf(stderr, "ERROR:%s: unable to open socket.\n", _socket);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+
+    // Clients that go away must not terminate the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    mutex_init(&decode_cache_mutex);
+    serving = 1;
+
+    if (verbose) {
+        printf("Serving requests on ......... %s\n", _socket);
+        fflush(stdout);
+    }
+
+    while (1) {
+        client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
+        }
+        serve_request(client, _defaults, _argv[0]);
+        close(client);
+    }
 
-            _source += _configuration->depth;
+    close(server);
+#endif
 
-        }
-        if (verbose) {
-            printf("\n");
-        }
+}
 
+// This function sends the options to the server as a request, prints 
+// what the server sends back and returns the error level of the request.
+
+int send_request(char* _socket, int _argc, char* _argv[]) {
+
+#ifdef _WIN32
+    fprintf(stderr, "ERROR:: serving requests is not supported on this platform.\n");
+    usage_and_exit(ERL_WRONG_OPTIONS, _argc, _argv);
+    return ERL_WRONG_OPTIONS;
+#else
+    struct sockaddr_un address;
+    int client, i, length = 0, size = 4096, received;
+    char* response = malloc(size);
+    char* last;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, _socket, sizeof(address.sun_path) - 1);
+
+    client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client < 0 || connect(client, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "ERROR:%s: unable to connect to the server.\n", _socket);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
     }
 
-    if (verbose) {
-        printf("\n");
-        printf("\n");
+    // Options are sent as a single line, with double quotes around the
+    // ones with spaces.
+    for (i = 3; i < _argc; ++i) {
+        const char* format = strchr(_argv[i], ' ') ? "\"%s\"%s" : "%s%s";
+        char* option = malloc(strlen(_argv[i]) + 4);
+        sprintf(option, format, _argv[i], (i < _argc - 1) ? " " : "\n");
+        send(client, option, strlen(option), 0);
+        free(option);
+    }
+    if (_argc <= 3) {
+        send(client, "\n", 1, 0);
     }
-}
-
-// This function extract the "palette" of colors of the given image.
-int extract_color_palette(unsigned char* _source, Configuration* _configuration, RGB _palette[], int _palette_size) {
 
-    RGB rgb;
+    while ((received = (int)recv(client, response + length, size - length - 1, 0)) > 0) {
+        length += received;
+        if (length + 1 >= size) {
+            size *= 2;
+            response = realloc(response, size);
+        }
+    }
+    response[length] = 0;
+    close(client);
+
+    // The last line is the error level.
+    last = length > 0 ? response + length - 1 : response;
+    *last = 0;
+    last = strrchr(response, '\n');
+    last = last ? last + 1 : response;
+    if (strncmp(last, "EXIT ", 5) != 0) {
+        fprintf(stderr, "ERROR:%s: no answer from the server.\n", _socket);
+        return ERL_CANNOT_OPEN_INPUT;
+    }
+    fwrite(response, 1, last - response, stdout);
 
-    int image_x, image_y;
+    return atoi(last + 5);
+#endif
 
-    int usedPalette = 0;
-    int i = 0;
-    unsigned char* source = _source;
+}
 
-    if (verbose&&debug) {
-        printf("\nExtracting color palette from source image.\n\n");
-    }
+// This function fills a synthetic image for the benchmarks with pixels 
+// of the given distribution, chosen by a pseudo random generator (always 
+// the same sequence, so that each run measures the same image).
 
-    for (image_y = 0; image_y < _configuration->height; ++image_y) {
-        for (image_x = 0; image_x < _configuration->width; ++image_x) {
-            rgb.red = *source;
-            rgb.green = *(source + 1);
-            rgb.blue = *(source + 2);
+void generate_benchmark_image(unsigned char* _pixels, int _count, int _distribution) {
 
-            for (i = 0; i < usedPalette; ++i) {
-                if (_palette[i].red == rgb.red && _palette[i].green == rgb.green && _palette[i].blue == rgb.blue) {
-                    break;
-                }
-            }
+    unsigned int state = 2463534242u;
+    int i, j;
+    RGB color;
 
-            if (i >= usedPalette) {
-                if (verbose&&debug) {
-                    printf(" ");
-                }
-                _palette[usedPalette].red = rgb.red;
-                _palette[usedPalette].green = rgb.green;
-                _palette[usedPalette].blue = rgb.blue;
-                ++usedPalette;
-                if (usedPalette > _palette_size) {
-                    break;
-                }
+    for (i = 0; i < _count; ++i) {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        for (j = 0; j < 3; ++j) {
+            if (_distribution == BENCHMARK_NOISE) {
+                _pixels[i * 3 + j] = (unsigned char)(state >> (j * 8));
             } else {
-                if (verbose && debug) {
-                    printf("*");
-                }
+                color = COLORS[_distribution == BENCHMARK_TWO_COLORS ? (state & 1) : (state & 3)].color;
+                _pixels[i * 3 + j] = (unsigned char)(j == 0 ? color.red : (j == 1 ? color.green : color.blue));
             }
-            source += 3;
-        }
-        if (verbose) {
-            printf("\n");
-        }
-        if (usedPalette > _palette_size) {
-            break;
         }
     }
 
-    if (verbose && debug) {
-        printf("\n\nDetected %d different colors.\n", usedPalette);
-        for (i = 0; i < usedPalette; ++i) {
-            printf("%d) 0x%02.2x%02.2x%02.2x\n", i, _palette[i].red, _palette[i].green, _palette[i].blue );
-        }
+}
+
+// This function runs once a kernel on a synthetic image. Kernels that work
+// on a single pixel are run on each pixel of the image.
+
+void run_benchmark_kernel(int _kernel, unsigned char* _pixels, Configuration* _configuration, ColorAnalysis* _analysis, Output* _output) {
+
+    int i, count = _configuration->width * _configuration->height;
+    long sink = 0;
+    RGB color;
+    RGB palette[4];
+
+    switch (_kernel) {
+        case BENCHMARK_LUMINANCE:
+            for (i = 0; i < count; ++i) {
+                color.red = _pixels[i * 3];
+                color.green = _pixels[i * 3 + 1];
+                color.blue = _pixels[i * 3 + 2];
+                sink += calculate_luminance(color);
+            }
+            break;
+        case BENCHMARK_DISTANCE:
+            for (i = 0; i < count; ++i) {
+                color.red = _pixels[i * 3];
+                color.green = _pixels[i * 3 + 1];
+                color.blue = _pixels[i * 3 + 2];
+                sink += calculate_distance(color, _analysis->palette[i & 3]);
+            }
+            break;
+        case BENCHMARK_PALETTE:
+            sink = extract_color_palette(_pixels, _configuration, palette, 4);
+            break;
+        case BENCHMARK_HIRES:
+            convert_image_into_tiles(_pixels, _configuration, _output, 0);
+            break;
+        case BENCHMARK_MULTICOLOR:
+            convert_image_into_multicolor_tiles(_pixels, _configuration, _analysis, _output, 0);
+            break;
     }
 
-    return usedPalette;
+    benchmark_sink += sink;
 
 }
 
-// This function convert an image of (W,H) pixels in a set of (WT,HT) multicolor
-// tiles. Each tile will have the half of horizontal resolution but four colors
-// for each pixel. Tiles will be drawn in a "contiguous" way, i.e. each row of 
-// multicolor tiles will be drawn sequentially, and each column for each row 
-// the same. 
-void convert_image_into_multicolor_tiles(unsigned char* _source, Configuration* _configuration, Output* _output) {
+// This function compares two times, to sort them.
 
-    // Position of the pixel in the original image
-    int image_x, image_y;
+int compare_times(const void* _a, const void* _b) {
 
-    // Position of the pixel, in terms of tiles
-    int tile_x, tile_y;
+    double a = *(const double*)_a;
+    double b = *(const double*)_b;
 
-    // Position of the pixel, in terms of offset and bitmask
-    int offset, bitmask;
+    return (a > b) - (a < b);
 
-    // Color of the pixel to convert
-    RGB rgb;
+}
+
+// This function measures a kernel on a synthetic image: after warming up
+// the caches, the kernel is repeated (see BENCHMARK_TIME) and the times 
+// taken are sorted, to find the fastest, the median and the slowest.
+
+void measure_benchmark_kernel(int _kernel, unsigned char* _pixels, Configuration* _configuration, ColorAnalysis* _analysis, Output* _output, BenchmarkResult* _result) {
+
+    double times[BENCHMARK_MAXIMUM_REPETITIONS];
+    double start, total = 0;
+    double pixels = (double)_configuration->width * _configuration->height;
+    int i, repetitions = 0;
 
-    int previous_tiles_count = _output->tiles_count;
-    int actual_tiles_count = _configuration->width_tiles * _configuration->height_tiles;
+    for (i = 0; i < BENCHMARK_WARM_UP; ++i) {
+        run_benchmark_kernel(_kernel, _pixels, _configuration, _analysis, _output);
+    }
+
+    while (repetitions < BENCHMARK_MAXIMUM_REPETITIONS && (repetitions < BENCHMARK_MINIMUM_REPETITIONS || total < BENCHMARK_TIME)) {
+        start = get_monotonic_time();
+        run_benchmark_kernel(_kernel, _pixels, _configuration, _analysis, _output);
+        times[repetitions] = get_monotonic_time() - start;
+        total += times[repetitions++];
+    }
 
-    int i = 0;
+    qsort(times, repetitions, sizeof(double), compare_times);
 
-    // Normalize the input image based on colors.
-    RGB palette[256];
-    int usedPalette = 0;
-    int minDistance, colorIndex;
+    _result->minimum = times[0] * 1e9 / pixels;
+    _result->median = times[repetitions / 2] * 1e9 / pixels;
+    _result->maximum = times[repetitions - 1] * 1e9 / pixels;
+    _result->throughput = times[repetitions / 2] > 0 ? pixels * 3 / times[repetitions / 2] / 1e9 : 0;
 
-    usedPalette = extract_color_palette(_source, _configuration, palette, 256);
+}
 
-    if (_output->tiles_count == 0) {
+// This function reads the results of a previous run of the benchmarks, as
+// written by print_benchmark_result (lines starting with "#" are ignored).
+// It returns the number of results read.
 
-        // Calculate the surface area, in terms of tiles
-        _output->tiles_count = actual_tiles_count;
+int read_benchmark_results(char* _filename, BenchmarkResult** _results, int _argc, char* _argv[]) {
 
-        // Allocate enough memory
-        _output->tiles = malloc(_output->tiles_count * 8);
+    char line[256];
+    int count = 0, size = 0;
+    BenchmarkResult result;
+    FILE* handle = fopen(_filename, "rt");
 
-        // Clear the tiles.
-        memset(_output->tiles, 0, _output->tiles_count * 8);
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR:%s: unable to open file\n", _filename);
+        usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
+    }
 
+    *_results = NULL;
+    while (fgets(line, sizeof(line), handle) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63s %15s %15s %lf %lf %lf %lf", result.kernel, result.image, result.distribution, &result.minimum, &result.median, &result.maximum, &result.throughput) != 7) {
+            continue;
+        }
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            *_results = realloc(*_results, sizeof(BenchmarkResult) * size);
+        }
+        (*_results)[count++] = result;
     }
-    else {
 
-        // Update the surface area, in terms of tiles
-        _output->tiles_count += actual_tiles_count;
+    fclose(handle);
+
+    return count;
+
+}
 
-        // Reallocate memory
-        _output->tiles = realloc(_output->tiles, _output->tiles_count * 8);
+// This function prints the result of a benchmark, a line for each one. If
+// the same benchmark is found into the previous results, it also prints 
+// how many times faster the kernel is now (by the median time).
 
-        // Clear the tiles.
-        memset(_output->tiles + previous_tiles_count * 8, 0, actual_tiles_count * 8);
+void print_benchmark_result(BenchmarkResult* _result, BenchmarkResult* _baseline, int _baseline_count) {
 
+    int i;
+
+    printf("%-44s %-10s %-8s %10.3f %10.3f %10.3f %8.3f", _result->kernel, _result->image, _result->distribution, _result->minimum, _result->median, _result->maximum, _result->throughput);
+
+    for (i = 0; i < _baseline_count; ++i) {
+        if (strcmp(_baseline[i].kernel, _result->kernel) == 0 && strcmp(_baseline[i].image, _result->image) == 0 && strcmp(_baseline[i].distribution, _result->distribution) == 0) {
+            printf(" %8.2fx", _result->median > 0 ? _baseline[i].median / _result->median : 0);
+            break;
+        }
     }
 
-    // Loop for all the source surface.
-    for (image_y = 0; image_y < _configuration->height; ++image_y) {
-        for (image_x = 0; image_x < _configuration->width; ++image_x) {
+    printf("\n");
+    fflush(stdout);
 
-            // Take the color of the pixel
-            rgb.red = *_source;
-            rgb.green = *(_source + 1);
-            rgb.blue = *(_source + 2);
+}
 
-            // Calculate the relative tile
-            tile_y = (image_y >> 3);
-            tile_x = (image_x >> 2);
+// This function runs the benchmarks of the kernels (see --benchmark): each
+// kernel is measured on synthetic images of each size and distribution 
+// (images with more than 4 colors are not used for the palette and for 
+// multicolor tiles), and each conversion kernel with each instruction set 
+// available. Kernels are run by a single thread, without any output.
+
+void run_benchmarks(int _argc, char* _argv[]) {
+
+    int i, level, levels;
+    int size, distribution, kernel;
+    unsigned char* pixels;
+    Configuration benchmark_configuration;
+    ColorAnalysis analysis;
+    Output output;
+    BenchmarkResult result;
+    BenchmarkResult* baseline = NULL;
+    int baseline_count = 0;
+    int detected_simd_level = simd_level;
+
+    if (filename_benchmark_baseline != NULL) {
+        baseline_count = read_benchmark_results(filename_benchmark_baseline, &baseline, _argc, _argv);
+    }
 
-            // Calculate the offset starting from the tile surface area
-            // and the bit to set.
-            offset = (tile_y * 8 * _configuration->width_tiles) + (tile_x * 8) + (image_y & 0x07);
+    verbose = 0;
+    band_jobs = 1;
 
-            minDistance = 0xffff;
-            colorIndex = 0;
+    printf("# %-42s %-10s %-8s %10s %10s %10s %8s%s\n", "kernel", "image", "colors", "min ns/px", "median", "max", "GB/s", baseline_count > 0 ? "  speedup" : "");
 
-            for (i = 0; i < 4; ++i) {
-                if (calculate_distance(rgb, palette[i]) < minDistance) {
-                    minDistance = calculate_distance(rgb, palette[i]);
-                    colorIndex = i;
-                };
-            }
+    for (i = 0; i < sizeof(BENCHMARK_SIZES) / sizeof(int); ++i) {
 
-            bitmask = colorIndex << (6 - ((image_x & 0x3) * 2));
+        size = BENCHMARK_SIZES[i];
+        pixels = malloc(size * size * 3);
+        output.tiles = malloc(size * size / 4);
+        output.tiles_count = size * size / 32;
+        output.map = NULL;
+        output.map_count = 0;
+        output.flips = NULL;
 
-            *(_output->tiles + (previous_tiles_count * 8) + offset) |= bitmask;
+        for (distribution = BENCHMARK_TWO_COLORS; distribution <= BENCHMARK_NOISE; ++distribution) {
 
-            if (verbose) {
-                printf("%1.1d", colorIndex, bitmask);
-            }
+            generate_benchmark_image(pixels, size * size, distribution);
 
-            _source += _configuration->depth;
+            for (kernel = BENCHMARK_LUMINANCE; kernel <= BENCHMARK_MULTICOLOR; ++kernel) {
+
+                if (distribution == BENCHMARK_NOISE && (kernel == BENCHMARK_PALETTE || kernel == BENCHMARK_MULTICOLOR)) {
+                    continue;
+                }
+
+                benchmark_configuration = configuration;
+                benchmark_configuration.width = size;
+                benchmark_configuration.height = size;
+                benchmark_configuration.depth = 3;
+                benchmark_configuration.row_size = size * 3;
+                benchmark_configuration.multicolor = kernel == BENCHMARK_MULTICOLOR;
+                benchmark_configuration.width_tiles = size / (benchmark_configuration.multicolor ? 4 : 8);
+                benchmark_configuration.height_tiles = size / 8;
+
+                // The palette of the image (any color, for noise).
+                analysis.colors_count = extract_color_palette(pixels, &benchmark_configuration, analysis.palette, 4);
+                if (analysis.colors_count > 4) {
+                    analysis.colors_count = 4;
+                }
+                match_palette_colors(&benchmark_configuration, &analysis);
+
+                // Multicolor tiles have no kernel using AVX2.
+                if (kernel == BENCHMARK_HIRES) {
+                    levels = detected_simd_level;
+                } else if (kernel == BENCHMARK_MULTICOLOR) {
+                    levels = detected_simd_level < SIMD_SSE2 ? detected_simd_level : SIMD_SSE2;
+                } else {
+                    levels = SIMD_NONE;
+                }
+
+                for (level = SIMD_NONE; level <= levels; ++level) {
+                    simd_level = level;
+                    if (kernel == BENCHMARK_HIRES || kernel == BENCHMARK_MULTICOLOR) {
+                        sprintf(result.kernel, "%s/%s", BENCHMARK_KERNELS[kernel], SIMD_NAMES[level]);
+                    } else {
+                        strcpy(result.kernel, BENCHMARK_KERNELS[kernel]);
+                    }
+                    sprintf(result.image, "%dx%d", size, size);
+                    strcpy(result.distribution, BENCHMARK_DISTRIBUTIONS[distribution]);
+                    measure_benchmark_kernel(kernel, pixels, &benchmark_configuration, &analysis, &output, &result);
+                    print_benchmark_result(&result, baseline, baseline_count);
+                }
+
+                simd_level = detected_simd_level;
+
+            }
 
-        }
-        if (verbose) {
-            printf("\n");
         }
 
-    }
+        free(pixels);
+        free(output.tiles);
 
-    if (verbose) {
-        printf("\n");
-        printf("\n");
     }
+
+    free(baseline);
+
 }
 
-// Main function
-int main(int _argc, char *_argv[]) {
+// This function generates a synthetic image of the corpus (see --corpus),
+// always the same for the same distribution and size: two or four colors
+// are put in runs of random length (up to 16 pixels), while photographic 
+// images are made of gradients, with some random noise.
 
-    int i = 0, j = 0, k = 0, m = 0;
+void generate_corpus_image(CorpusImage* _image, int _distribution, int _width, int _height) {
 
-    parse_options(_argc, _argv);
+    unsigned int state = 2463534242u;
+    int x, y, j, run = 0, index = 0;
+    unsigned char* pixel;
 
-    if (filename_in_count == 0 ) {
-        fprintf(stderr, "ERROR:: missing input filename.\n");
-        usage_and_exit(ERL_MISSING_INPUT_FILENAME, _argc, _argv);
-    }
+    _image->width = _width;
+    _image->height = _height;
+    _image->pixels = malloc((size_t)_width * _height * 3);
+    _image->indexes = NULL;
+    _image->colors = 0;
 
-    if (filename_out == NULL) {
-        fprintf(stderr, "ERROR:: missing output filename for luminance.\n");
-        usage_and_exit(ERL_MISSING_OUTPUT_FILENAME, _argc, _argv);
+    if (_distribution != CORPUS_PHOTOGRAPHIC) {
+        _image->colors = _distribution == CORPUS_TWO_COLORS ? 2 : 4;
+        _image->indexes = malloc((size_t)_width * _height);
+        for (j = 0; j < _image->colors; ++j) {
+            _image->palette[j] = COLORS[j].color;
+        }
     }
 
-    if (verbose) {
-        for (i = 0; i < filename_in_count; ++i) {
-            printf("Input image ................. %s\n", filename_in[i]);
+    for (y = 0; y < _height; ++y) {
+        for (x = 0; x < _width; ++x) {
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            pixel = &_image->pixels[((size_t)y * _width + x) * 3];
+            if (_image->colors > 0) {
+                if (run == 0) {
+                    index = state % _image->colors;
+                    run = 1 + ((state >> 8) & 15);
+                }
+                --run;
+                _image->indexes[(size_t)y * _width + x] = (unsigned char)index;
+                pixel[0] = (unsigned char)_image->palette[index].red;
+                pixel[1] = (unsigned char)_image->palette[index].green;
+                pixel[2] = (unsigned char)_image->palette[index].blue;
+            } else {
+                pixel[0] = (unsigned char)((long long)x * 224 / _width + (state & 31));
+                pixel[1] = (unsigned char)((long long)y * 224 / _height + ((state >> 8) & 31));
+                pixel[2] = (unsigned char)((long long)(x + y) * 224 / (_width + _height) + ((state >> 16) & 31));
+            }
         }
-        printf("Output tile(s) .............. %s\n", filename_out);
     }
 
-    RGB palette[256];
-    int nearestColorIndex[4];
+}
 
-    Output result;
-    result.tiles_count = 0;
+// These functions write a number of 16 or 32 bits (little or big endian).
 
-    for (i = 0; i < filename_in_count; ++i) {
+void write_le16(FILE* _handle, unsigned int _value) {
 
-        configuration.width = 0;
-        configuration.height = 0;
-        configuration.depth = 3;
+    fputc(_value & 0xff, _handle);
+    fputc((_value >> 8) & 0xff, _handle);
 
-        unsigned char* source = stbi_load(filename_in[i], &configuration.width, &configuration.height, &configuration.depth, 0);
+}
 
-        if (source == NULL) {
-            fprintf(stderr, "ERROR:%s: unable to open file\n", filename_in[i]);
-            usage_and_exit(ERL_CANNOT_OPEN_INPUT, _argc, _argv);
-        }
+void write_le32(FILE* _handle, unsigned int _value) {
 
-        if (configuration.multicolor) {
-            if ((configuration.width & 0x03) != 0) {
-                fprintf(stderr, "ERROR:%s: cannot convert images with width (%d) not multiple of 4 pixels.\n", filename_in[i], configuration.width);
-                usage_and_exit(ERL_CANNOT_CONVERT_WIDTH, _argc, _argv);
-            }
-            configuration.width_tiles = configuration.width >> 2;
-        } else {
-            if ((configuration.width & 0x07) != 0) {
-                fprintf(stderr, "ERROR:%s: cannot convert images with width (%d) not multiple of 8 pixels.\n", filename_in[i], configuration.width);
-                usage_and_exit(ERL_CANNOT_CONVERT_WIDTH, _argc, _argv);
-            }
-            configuration.width_tiles = configuration.width >> 3;
+    write_le16(_handle, _value & 0xffff);
+    write_le16(_handle, _value >> 16);
+
+}
+
+void write_be32(FILE* _handle, unsigned int _value) {
+
+    fputc((_value >> 24) & 0xff, _handle);
+    fputc((_value >> 16) & 0xff, _handle);
+    fputc((_value >> 8) & 0xff, _handle);
+    fputc(_value & 0xff, _handle);
+
+}
+
+// This function writes an image as binary PPM.
+
+void write_ppm_image(FILE* _handle, CorpusImage* _image) {
+
+    fprintf(_handle, "P6\n%d %d\n255\n", _image->width, _image->height);
+    fwrite(_image->pixels, 3, (size_t)_image->width * _image->height, _handle);
+
+}
+
+// This function writes an image as BMP, with 24 bits per pixel: rows are
+// written from the last one, in blue, green, red order, and each row is 
+// padded to a multiple of 4 bytes.
+
+void write_bmp_image(FILE* _handle, CorpusImage* _image) {
+
+    int row_size = (_image->width * 3 + 3) & ~3;
+    unsigned char* row = calloc(row_size, 1);
+    unsigned char* pixel;
+    int x, y;
+
+    fputc('B', _handle);
+    fputc('M', _handle);
+    write_le32(_handle, 54 + row_size * _image->height);
+    write_le32(_handle, 0);
+    write_le32(_handle, 54);
+    write_le32(_handle, 40);
+    write_le32(_handle, _image->width);
+    write_le32(_handle, _image->height);
+    write_le16(_handle, 1);
+    write_le16(_handle, 24);
+    write_le32(_handle, 0);
+    write_le32(_handle, row_size * _image->height);
+    write_le32(_handle, 2835);
+    write_le32(_handle, 2835);
+    write_le32(_handle, 0);
+    write_le32(_handle, 0);
+
+    for (y = _image->height - 1; y >= 0; --y) {
+        for (x = 0; x < _image->width; ++x) {
+            pixel = &_image->pixels[((size_t)y * _image->width + x) * 3];
+            row[x * 3] = pixel[2];
+            row[x * 3 + 1] = pixel[1];
+            row[x * 3 + 2] = pixel[0];
         }
+        fwrite(row, 1, row_size, _handle);
+    }
 
-        if (configuration.multicolor) {
-            if ((configuration.height & 0x03) != 0) {
-                fprintf(stderr, "ERROR:%s: cannot convert images with height (%d) not multiple of 8 pixels.\n", filename_in[i], configuration.height);
-                usage_and_exit(ERL_CANNOT_CONVERT_HEIGHT, _argc, _argv);
-            }
-            configuration.height_tiles = configuration.height >> 3;
-        } else {
-            if ((configuration.height & 0x07) != 0) {
-                fprintf(stderr, "ERROR:%s: cannot convert images with height (%d) not multiple of 8 pixels.\n", filename_in[i], configuration.height);
-                usage_and_exit(ERL_CANNOT_CONVERT_HEIGHT, _argc, _argv);
+    free(row);
+
+}
+
+// This function continues the calculation of the CRC used by PNG images.
+
+unsigned int calculate_crc32(unsigned int _crc, unsigned char* _data, size_t _size) {
+
+    unsigned int c;
+    size_t i;
+    int j;
+
+    if (CRC32_TABLE[1] == 0) {
+        for (i = 0; i < 256; ++i) {
+            c = (unsigned int)i;
+            for (j = 0; j < 8; ++j) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
             }
-            configuration.height_tiles = configuration.height >> 3;
+            CRC32_TABLE[i] = c;
         }
+    }
 
-        if (configuration.multicolor) {
-            if (extract_color_palette(source, &configuration, palette, 256) > 4) {
-                fprintf(stderr, "ERROR:%s: cannot convert images with more than 4 colors.\n", filename_in[i]);
-                usage_and_exit(ERL_CANNOT_CONVERT_COLORS, _argc, _argv);
-            }
-            if (verbose && debug) {
-                printf("\n\nCalculating nearest colors.\n");
-            }
-            if (configuration.background != -1) {
-                if (verbose && debug) {
-                    printf("\n\nStarting from background color.\n");
-                }
-                int minDistance = 0xffff;
-                int minColorIndex = 0, distance = 0;
-                for (k = 0; k < 4; ++k) {
-                    distance = calculate_distance(palette[k], COLORS[configuration.background].color);
-                    if (verbose && debug) {
-                        printf("%d) 0x%02.2x%02.2x%02.2x => (%d) => %20.20s] 0x%02.2x%02.2x%02.2x\n", configuration.background, 
-                            palette[k].red, palette[k].green, palette[k].blue,
-                            distance,
-                            COLORS[configuration.background].name, COLORS[configuration.background].color.red, COLORS[configuration.background].color.green, COLORS[configuration.background].color.blue);
-                    }
+    _crc = ~_crc;
+    for (i = 0; i < _size; ++i) {
+        _crc = CRC32_TABLE[(_crc ^ _data[i]) & 0xff] ^ (_crc >> 8);
+    }
 
-                    if (distance < minDistance) {
-                        minColorIndex = k;
-                        minDistance = distance;
-                    }
-                }
-                RGB temp = palette[minColorIndex];
-                palette[minColorIndex] = palette[0];
-                palette[0] = temp;
-            }
-            for (j = 0; j < 4; ++j) {
-                int minDistance = 0xffff;
-                int minColorIndex = 0, distance = 0;
-                for (k = 0; k < sizeof(COLORS) / sizeof(NamedRGB); ++k) {
-                    distance = calculate_distance(palette[j], COLORS[k].color);
-                    if (verbose && debug) {
-                        printf("%d) %20.20s] 0x%02.2x%02.2x%02.2x => (%d) => 0x%02.2x%02.2x%02.2x\n", j, COLORS[k].name,
-                            palette[j].red, palette[j].green, palette[j].blue,
-                            distance,
-                            COLORS[k].color.red, COLORS[k].color.green, COLORS[k].color.blue);
-                    }
+    return ~_crc;
 
-                    if (distance < minDistance) {
-                        for (m = 0; m < j; ++m) {
-                            if (nearestColorIndex[m] == k) {
-                                break;
-                            }
-                        }
-                        if (m >= j) {
-                            minColorIndex = k;
-                            minDistance = distance;
-                        }
-                    }
-                }
-                if (verbose && debug) {
-                    printf("\n");
-                    printf("%d) 0x%02.2x%02.2x%02.2x => (%d) => 0x%02.2x%02.2x%02.2x\n", j,
-                            palette[j].red, palette[j].green, palette[j].blue, 
-                            minDistance,
-                            COLORS[minColorIndex].color.red, COLORS[minColorIndex].color.green, COLORS[minColorIndex].color.blue);
-                }
-                nearestColorIndex[j] = minColorIndex;
-            }
-            if (verbose && debug) {
-                printf("\n");
+}
+
+// This function writes a chunk of a PNG image: its size, its type, its 
+// data and the CRC of type and data.
+
+void write_png_chunk(FILE* _handle, const char* _type, unsigned char* _data, size_t _size) {
+
+    write_be32(_handle, (unsigned int)_size);
+    fwrite(_type, 1, 4, _handle);
+    fwrite(_data, 1, _size, _handle);
+    write_be32(_handle, calculate_crc32(calculate_crc32(0, (unsigned char*)_type, 4), _data, _size));
+
+}
+
+// This function writes an image as PNG: images with two or four colors 
+// are indexed, with 1 or 2 bits for each pixel, the others have three 
+// components. Rows are not filtered, and the deflate stream is made of 
+// blocks stored without compression (the image is read as usual).
+
+void write_png_image(FILE* _handle, CorpusImage* _image) {
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    unsigned char header[13];
+    unsigned char palette[12];
+    int bits = _image->colors == 2 ? 1 : (_image->colors == 4 ? 2 : 8);
+    size_t line_size = _image->colors > 0 ? ((size_t)_image->width * bits + 7) / 8 : (size_t)_image->width * 3;
+    size_t raw_size = (line_size + 1) * _image->height;
+    size_t blocks = (raw_size + 65534) / 65535;
+    unsigned char* raw = calloc(raw_size, 1);
+    unsigned char* stream = malloc(raw_size + blocks * 5 + 6);
+    unsigned char* line;
+    unsigned char* output = stream;
+    unsigned int s1 = 1, s2 = 0, index;
+    size_t i, size;
+    int x, y;
+
+    for (y = 0; y < _image->height; ++y) {
+        line = raw + (line_size + 1) * y + 1;
+        if (_image->colors > 0) {
+            for (x = 0; x < _image->width; ++x) {
+                index = _image->indexes[(size_t)y * _image->width + x];
+                line[x * bits / 8] |= index << (8 - bits - (x * bits) % 8);
             }
+        } else {
+            memcpy(line, _image->pixels + line_size * y, line_size);
         }
+    }
 
-        if (verbose) {
-            printf(" %s: (%dx%d, %d bpp) -> (%dx%d, %d bpp)\n", filename_in[i], configuration.width, configuration.height, configuration.depth, configuration.width_tiles, configuration.height_tiles, 1+configuration.multicolor );
+    // zlib header, stored blocks and Adler-32 checksum of the data.
+    *output++ = 0x78;
+    *output++ = 0x01;
+    for (i = 0; i < raw_size; i += size) {
+        size = raw_size - i < 65535 ? raw_size - i : 65535;
+        *output++ = i + size == raw_size ? 1 : 0;
+        *output++ = size & 0xff;
+        *output++ = (size >> 8) & 0xff;
+        *output++ = ~size & 0xff;
+        *output++ = (~size >> 8) & 0xff;
+        memcpy(output, raw + i, size);
+        output += size;
+    }
+    for (i = 0; i < raw_size; ++i) {
+        s1 = (s1 + raw[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    *output++ = (s2 >> 8) & 0xff;
+    *output++ = s2 & 0xff;
+    *output++ = (s1 >> 8) & 0xff;
+    *output++ = s1 & 0xff;
+
+    fwrite(signature, 1, 8, _handle);
+    header[0] = (_image->width >> 24) & 0xff;
+    header[1] = (_image->width >> 16) & 0xff;
+    header[2] = (_image->width >> 8) & 0xff;
+    header[3] = _image->width & 0xff;
+    header[4] = (_image->height >> 24) & 0xff;
+    header[5] = (_image->height >> 16) & 0xff;
+    header[6] = (_image->height >> 8) & 0xff;
+    header[7] = _image->height & 0xff;
+    header[8] = (unsigned char)bits;
+    header[9] = _image->colors > 0 ? 3 : 2;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+    write_png_chunk(_handle, "IHDR", header, 13);
+    if (_image->colors > 0) {
+        for (i = 0; i < (size_t)_image->colors; ++i) {
+            palette[i * 3] = (unsigned char)_image->palette[i].red;
+            palette[i * 3 + 1] = (unsigned char)_image->palette[i].green;
+            palette[i * 3 + 2] = (unsigned char)_image->palette[i].blue;
         }
+        write_png_chunk(_handle, "PLTE", palette, _image->colors * 3);
+    }
+    write_png_chunk(_handle, "IDAT", stream, output - stream);
+    write_png_chunk(_handle, "IEND", NULL, 0);
 
-        width_in_tiles[i] = configuration.width_tiles;
-        height_in_tiles[i] = configuration.height_tiles;
-        starting_tile[i] = result.tiles_count;
+    free(raw);
+    free(stream);
 
-        if (configuration.multicolor) {
-            convert_image_into_multicolor_tiles(source, &configuration, &result);
-        } else {
-            convert_image_into_tiles(source, &configuration, &result);
-        }
+}
 
-        stbi_image_free(source);
+// This function adds a code of 9 bits to the data of a GIF image.
 
-    }
+void add_gif_code(unsigned char* _data, size_t* _size, unsigned int* _bits, int* _bits_count, unsigned int _code) {
 
-    FILE *handle = fopen(filename_out, "w+b");
-    if (handle == NULL) {
-        fprintf(stderr, "ERROR:: unable to open output file '%s'.\n", filename_out);
-        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    *_bits |= _code << *_bits_count;
+    *_bits_count += 9;
+    while (*_bits_count >= 8) {
+        _data[(*_size)++] = *_bits & 0xff;
+        *_bits >>= 8;
+        *_bits_count -= 8;
     }
 
-    fwrite(result.tiles, 8, result.tiles_count, handle);
-    fclose(handle);
+}
 
-    if (filename_header != NULL) {
-        unsigned char buffer[80];
-        sprintf(buffer, "%d", 0);
-        FILE* handle = fopen(filename_header, "w+t");
-        if (handle == NULL) {
-            fprintf(stderr, "ERROR:: unable to open header file %s\n", filename_header);
-            usage_and_exit(ERL_CANNOT_OPEN_HEADER, _argc, _argv);
+// This function writes an image as GIF, with a palette of 256 colors: the
+// palette of the image, or a cube of 6x7x6 colors for photographic images
+// (whose pixels are reduced to the nearest one). Pixels are not 
+// compressed: each one is given as a code of 9 bits, and the table of 
+// codes is cleared before it would need codes of 10 bits.
+
+void write_gif_image(FILE* _handle, CorpusImage* _image) {
+
+    unsigned char palette[768];
+    size_t count = (size_t)_image->width * _image->height;
+    unsigned char* data = malloc(count * 2 + 16);
+    unsigned char* pixel;
+    unsigned int bits = 0, index;
+    int bits_count = 0, literals = 0;
+    size_t i, size = 0;
+
+    memset(palette, 0, sizeof(palette));
+    for (i = 0; i < 256; ++i) {
+        if (_image->colors > 0 && i < (size_t)_image->colors) {
+            palette[i * 3] = (unsigned char)_image->palette[i].red;
+            palette[i * 3 + 1] = (unsigned char)_image->palette[i].green;
+            palette[i * 3 + 2] = (unsigned char)_image->palette[i].blue;
+        } else if (_image->colors == 0 && i < 252) {
+            palette[i * 3] = (unsigned char)((i / 42) * 255 / 5);
+            palette[i * 3 + 1] = (unsigned char)(((i / 6) % 7) * 255 / 6);
+            palette[i * 3 + 2] = (unsigned char)((i % 6) * 255 / 5);
         }
-        if (configuration.bank > 0) {
-            fprintf(handle, "#ifndef _TILES%d_\n", configuration.bank);
-            fprintf(handle, "\n\t#define TILE%d_START%*s\n", configuration.bank, 35, buffer);
+    }
+
+    // Clear code (256), a code for each pixel, end code (257).
+    add_gif_code(data, &size, &bits, &bits_count, 256);
+    for (i = 0; i < count; ++i) {
+        if (literals == 253) {
+            add_gif_code(data, &size, &bits, &bits_count, 256);
+            literals = 0;
         }
-        else {
-            fprintf(handle, "#ifndef _TILES_\n");
-            fprintf(handle, "\n\t#define TILE_START%*s\n", 35, buffer);
+        if (_image->colors > 0) {
+            index = _image->indexes[i];
+        } else {
+            pixel = &_image->pixels[i * 3];
+            index = (pixel[0] * 6 / 256) * 42 + (pixel[1] * 7 / 256) * 6 + pixel[2] * 6 / 256;
         }
-        if (configuration.multicolor) {
-            for (i = 0; i < 4; ++i) {
-                if (configuration.bank > 0) {
-                    fprintf(handle, "\n\t#define TILE%d_COLOR%d%*sMR_COLOR_%s", configuration.bank, i, 33, " ", COLORS[nearestColorIndex[i]].name);
-                } else {
-                    fprintf(handle, "\n\t#define TILE_COLOR%d%*sMR_COLOR_%s", i, 33, " ", COLORS[nearestColorIndex[i]].name);
+        add_gif_code(data, &size, &bits, &bits_count, index);
+        ++literals;
+    }
+    add_gif_code(data, &size, &bits, &bits_count, 257);
+    if (bits_count > 0) {
+        data[size++] = bits & 0xff;
+    }
+
+    fwrite("GIF89a", 1, 6, _handle);
+    write_le16(_handle, _image->width);
+    write_le16(_handle, _image->height);
+    fputc(0xf7, _handle);
+    fputc(0, _handle);
+    fputc(0, _handle);
+    fwrite(palette, 1, sizeof(palette), _handle);
+    fputc(0x2c, _handle);
+    write_le16(_handle, 0);
+    write_le16(_handle, 0);
+    write_le16(_handle, _image->width);
+    write_le16(_handle, _image->height);
+    fputc(0, _handle);
+    fputc(8, _handle);
+    for (i = 0; i < size; i += 255) {
+        fputc(size - i < 255 ? (int)(size - i) : 255, _handle);
+        fwrite(data + i, 1, size - i < 255 ? size - i : 255, _handle);
+    }
+    fputc(0, _handle);
+    fputc(0x3b, _handle);
+
+    free(data);
+
+}
+
+// This function writes a corpus of synthetic images into the given 
+// directory (see --corpus), always the same: an image for each format, 
+// distribution of colors and size (8K only as indexed PNG), and a manifest
+// (corpus.txt) with a job for each format and distribution. Images with 
+// four colors are converted into multicolor tiles, photographic images 
+// with a luminance threshold of 128. The tiles and the C headers are 
+// written into the same directory.
+
+void generate_corpus(char* _directory, int _argc, char* _argv[]) {
+
+    int format, distribution, size, images = 0;
+    char* filename = malloc(strlen(_directory) + 64);
+    FILE* manifest;
+    FILE* handle;
+    CorpusImage image;
+
+    if (!create_directory(_directory)) {
+        fprintf(stderr, "ERROR:%s: unable to create directory\n", _directory);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+
+    sprintf(filename, "%s/corpus.txt", _directory);
+    manifest = fopen(filename, "wt");
+    if (manifest == NULL) {
+        fprintf(stderr, "ERROR:%s: unable to open file\n", filename);
+        usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+    }
+    fprintf(manifest, "# Corpus of synthetic images, written by img2tile --corpus\n");
+
+    for (distribution = CORPUS_TWO_COLORS; distribution <= CORPUS_PHOTOGRAPHIC; ++distribution) {
+        for (format = CORPUS_PPM; format <= CORPUS_GIF; ++format) {
+            for (size = 0; size < CORPUS_SIZES_COUNT; ++size) {
+                if (CORPUS_SIZES[size][0] > 4096 && (format != CORPUS_PNG || distribution == CORPUS_PHOTOGRAPHIC)) {
+                    continue;
                 }
+                sprintf(filename, "%s/%s_%dx%d.%s", _directory, CORPUS_DISTRIBUTIONS[distribution], CORPUS_SIZES[size][0], CORPUS_SIZES[size][1], CORPUS_FORMATS[format]);
+                handle = fopen(filename, "wb");
+                if (handle == NULL) {
+                    fprintf(stderr, "ERROR:%s: unable to open file\n", filename);
+                    usage_and_exit(ERL_CANNOT_OPEN_OUTPUT, _argc, _argv);
+                }
+                generate_corpus_image(&image, distribution, CORPUS_SIZES[size][0], CORPUS_SIZES[size][1]);
+                switch (format) {
+                    case CORPUS_PPM:
+                        write_ppm_image(handle, &image);
+                        break;
+                    case CORPUS_BMP:
+                        write_bmp_image(handle, &image);
+                        break;
+                    case CORPUS_PNG:
+                        write_png_image(handle, &image);
+                        break;
+                    case CORPUS_GIF:
+                        write_gif_image(handle, &image);
+                        break;
+                }
+                fclose(handle);
+                free(image.pixels);
+                free(image.indexes);
+                fprintf(manifest, "%s\"%s\"", size == 0 ? "-i " : " -i ", filename);
+                ++images;
             }
+            sprintf(filename, "%s/%s_%s", _directory, CORPUS_DISTRIBUTIONS[distribution], CORPUS_FORMATS[format]);
+            fprintf(manifest, " -o \"%s.bin\" -g \"%s.h\"%s\n", filename, filename, distribution == CORPUS_FOUR_COLORS ? " -m" : (distribution == CORPUS_PHOTOGRAPHIC ? " -l 128" : ""));
         }
-        fprintf(handle, "\n");
-        for (i = 0; i < filename_in_count; ++i) {
-            unsigned char* tilename = basename(filename_in[i]);
-            unsigned char* sep = strrchr(tilename, '_');
-            unsigned char* dot = strchr(tilename, '.');
-            *dot = 0;
-            if (sep == NULL) sep = tilename;
-            ++sep;
-            sep = strupr(sep);
-            sprintf(buffer, "%d", starting_tile[i]);
-            if (configuration.bank > 0) {
-                fprintf(handle, "\n\t#define TILE%d_%s%*s\n", configuration.bank, sep, (40 - strlen(sep)), buffer);
-            } else {
-                fprintf(handle, "\n\t#define TILE_%s%*s\n", sep, (40 - strlen(sep)), buffer);
-            }
-            sprintf(buffer, "%d", width_in_tiles[i]);
-            if (configuration.bank > 0) {
-                fprintf(handle, "\t#define TILE%d_%s_WIDTH%*s\n", configuration.bank, sep, (34 - strlen(sep)), buffer);
-            } else {
-                fprintf(handle, "\t#define TILE_%s_WIDTH%*s\n", sep, (34 - strlen(sep)), buffer);
-            }
-            sprintf(buffer, "%d", height_in_tiles[i]);
-            if (configuration.bank > 0) {
-                fprintf(handle, "\t#define TILE%d_%s_HEIGHT%*s\n", configuration.bank, sep, (33 - strlen(sep)), buffer);
-            } else {
-                fprintf(handle, "\t#define TILE_%s_HEIGHT%*s\n", sep, (33 - strlen(sep)), buffer);
-            }
-        }
-        sprintf(buffer, "%d", result.tiles_count);
-        if (configuration.bank > 0) {
-            fprintf(handle, "\n\t#define TILE%d_COUNT%*s\n", configuration.bank, 36, buffer);
-        } else {
-            fprintf(handle, "\n\t#define TILE_COUNT%*s\n", 36, buffer);
-        }
-        fprintf(handle, "#endif\n");
-        fclose(handle);
     }
 
+    fclose(manifest);
+    free(filename);
+
     if (verbose) {
-        printf("Wrote a total of %d tiles.\n\n", result.tiles_count);
+        printf("Corpus ...................... %d images into %s\n", images, _directory);
+    }
+
+}
+
+// Main function
+int main(int _argc, char *_argv[]) {
+
+    Job command_line;
+
+    // "--client <socket> [options]"
+    if (_argc > 2 && strcmp(_argv[1], "--client") == 0) {
+        return send_request(_argv[2], _argc, _argv);
+    }
+
+    init_job(&command_line, NULL);
+
+    parse_options(_argc, _argv, &command_line, OPTIONS_COMMAND_LINE);
+
+    simd_level = detect_simd_level();
+
+    mutex_init(&output_mutex);
+
+    if (benchmark) {
+        run_benchmarks(_argc, _argv);
+        return 0;
+    }
+
+    if (directory_corpus != NULL) {
+        generate_corpus(directory_corpus, _argc, _argv);
+        return 0;
+    }
+
+    if (filename_socket != NULL) {
+        serve_requests(filename_socket, &command_line, _argc, _argv);
+    } else {
+        run_jobs(&command_line, _argc, _argv);
     }
 
-}
\ No newline at end of file
+    return 0;
+
+}
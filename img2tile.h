@@ -78,15 +78,512 @@
 
         int background;
 
+        int row_size;
+
+        int bgr;
+
+        int luminance;
+
     } Configuration;
 
+    // This structure stores the luminance threshold in the form used by the
+    // conversion kernels: a pixel is "on" if the sum of the squares of its
+    // components is greater than (or, with some care, equal to) the square
+    // threshold, so no square root is needed for each pixel. Pixels with a
+    // single byte (luminance or grey) are "on" if it is at least the level.
+
+    typedef struct {
+
+        int threshold;
+
+        int square_threshold;
+
+        int level;
+
+        int reverse_mask;
+
+        int bgr;
+
+    } LuminanceThreshold;
+
+    // This structure stores the result of the analysis of the colors of an
+    // image to be converted into multicolor tiles: it is calculated once for
+    // each image, and used both for conversion and for the C header.
+
+    typedef struct {
+
+        RGB palette[4];
+
+        int colors_count;
+
+        int nearest_colors[4];
+
+    } ColorAnalysis;
+
+    // This structure maintains the statistics of an image of a job, or of 
+    // the job itself (see --stats): the time taken by each phase (in 
+    // seconds) and how much has been processed. Images use the phases from
+    // decoding to conversion, jobs the ones of writing their files.
+
+    typedef struct {
+
+        double decode;
+
+        double palette;
+
+        double matching;
+
+        double conversion;
+
+        double output;
+
+        double header;
+
+        long long pixels;
+
+        long long bytes;
+
+        int tiles;
+
+        int cached;
+
+    } Statistics;
+
+    // This structure maintains what is needed to convert the rows of tiles 
+    // (bands of 8 rows of pixels) of an image, so that they can be converted
+    // in parallel. Only one between threshold and palette is used.
+
+    typedef struct {
+
+        unsigned char* source;
+
+        unsigned char* end;
+
+        int row_size;
+
+        int depth;
+
+        int width_tiles;
+
+        LuminanceThreshold* threshold;
+
+        RGB* palette;
+
+        mr_mixel* tiles;
+
+    } ImageBands;
+
+    // This structure maintains the extraction of the palette of an image,
+    // that can be done a few rows at a time: the colors found (also into a
+    // small open addressing hash table, as packed RGB values plus one), 
+    // the color of the last pixel and the line shown for each row (in 
+    // verbose mode).
+
+    typedef struct {
+
+        Configuration* configuration;
+
+        RGB* palette;
+
+        int palette_size;
+
+        int count;
+
+        unsigned int* colors;
+
+        unsigned int mask;
+
+        unsigned int previous;
+
+        char* line;
+
+    } PaletteExtraction;
+
     // This structure maintain the result of conversion operation.
 
     typedef struct {
 
         mr_tile     tiles_count;
         mr_mixel*   tiles;
+        int*        map;
+        int         map_count;
+        unsigned char* flips;
 
     } Output;
 
+    // This structure maintains the contents of a file, mapped into memory
+    // (or read into memory, if the file cannot be mapped).
+
+    typedef struct {
+
+        unsigned char* data;
+
+        size_t size;
+
+        int mapped;
+
+    } MappedFile;
+
+    // This structure maintains an image to be converted. Since the same 
+    // image can be used by many jobs, it is decoded only once (when first
+    // needed) and freed after its last use. Uncompressed images are not 
+    // decoded at all (raw): their pixels are read directly from the file, 
+    // starting from the top row (which can be the last one of the file).
+    // Huge images are never decoded as a whole (streamed): they are read
+    // a band of 8 rows at a time, for each use (see --stream). Images not
+    // needed as colors (by multicolor jobs) are kept as a luminance plane,
+    // with a byte for each pixel (depth is still the one of the image).
+    // The size of the file is kept for the statistics (see --stats). The 
+    // server reads the time of last modification and the size of the file
+    // (its stamp) before opening it, to keep the decoded image (see --serve).
+
+    typedef struct {
+
+        char* filename;
+
+        int width;
+
+        int height;
+
+        int depth;
+
+        int row_size;
+
+        int bgr;
+
+        int uses;
+
+        int colors;
+
+        unsigned char* pixels;
+
+        int luminance;
+
+        int raw;
+
+        size_t raw_offset;
+
+        int streamed;
+
+        int cached;
+
+        int hashed;
+
+        unsigned long long hash;
+
+        MappedFile file;
+
+        long long file_size;
+
+        int stamped;
+
+        long long modified;
+
+        long long size;
+
+    } SharedImage;
+
+    // This structure maintains an image decoded by the server (see --serve):
+    // it is used again as long as the file does not change (same time of 
+    // last modification and same size), and freed when the least recently 
+    // used.
+
+    typedef struct {
+
+        char* filename;
+
+        long long modified;
+
+        long long size;
+
+        int width;
+
+        int height;
+
+        int depth;
+
+        unsigned char* pixels;
+
+        int luminance;
+
+        long long bytes;
+
+        int users;
+
+        unsigned long last_use;
+
+    } CachedImage;
+
+    // This structure maintains a job: the images to be converted (and the
+    // files they have been read from, see -M), the options used to convert
+    // them, where to write the result and the result itself. Many jobs can
+    // be executed at once (see --jobs).
+
+    typedef struct {
+
+        Configuration configuration;
+
+        char** filename_in;
+
+        int filename_in_count;
+
+        int filename_in_size;
+
+        char** filename_source;
+
+        int filename_source_count;
+
+        int* shared_image;
+
+        int* starting_tile;
+
+        int* width_in_tiles;
+
+        int* height_in_tiles;
+
+        ColorAnalysis* color_analysis;
+
+        Statistics* image_statistics;
+
+        char* filename_out;
+
+        char* filename_header;
+
+        char* filename_depend;
+
+        int deduplicate;
+
+        Output output;
+
+        Statistics statistics;
+
+    } Job;
+
+    // This structure maintains the conversion of an image of a job.
+
+    typedef struct {
+
+        Job* job;
+
+        int index;
+
+        int size;
+
+    } ConversionTask;
+
+    // This structure maintains what is needed to convert each image, when
+    // images are converted in parallel.
+
+    typedef struct {
+
+        ConversionTask* tasks;
+
+        Job* jobs;
+
+        int argc;
+
+        char** argv;
+
+    } ConversionContext;
+
+    // This is a function called for each band of (up to) 8 rows of an image
+    // read a band at a time, with its index. It returns 0 to stop reading.
+
+    typedef int (*BandCallback)(unsigned char* _source, int _row_size, int _rows, int _index, void* _context);
+
+    // This structure maintains a Huffman code of the deflate format: the 
+    // number of codes of each length, the symbols sorted by code, and a 
+    // table to decode the codes up to 9 bits with a single lookup (each
+    // entry is the length of the code, shifted by 9 bits, and the symbol).
+
+    typedef struct {
+
+        unsigned short counts[16];
+
+        unsigned short symbols[288];
+
+        unsigned short fast[512];
+
+    } HuffmanCode;
+
+    // This structure maintains the decoding of a PNG image a band of rows 
+    // at a time: the compressed data (split into IDAT chunks), the last 
+    // bytes decompressed (the deflate format refers to the last 32K bytes),
+    // the current and the previous row (needed by filters) and the band of
+    // rows being filled, that is given to the callback when full.
+
+    typedef struct {
+
+        unsigned char* data;
+
+        size_t size;
+
+        size_t position;
+
+        size_t chunk_end;
+
+        int overrun;
+
+        unsigned int bits;
+
+        int bits_count;
+
+        unsigned char* window;
+
+        unsigned long long written;
+
+        unsigned long long flushed;
+
+        int width;
+
+        int height;
+
+        int bit_depth;
+
+        int color;
+
+        int channels;
+
+        int depth;
+
+        unsigned char palette[1024];
+
+        int transparent;
+
+        unsigned short transparent_color[3];
+
+        int line_size;
+
+        int filter_bytes;
+
+        unsigned char* line;
+
+        unsigned char* previous;
+
+        int line_position;
+
+        int row;
+
+        unsigned char* band;
+
+        BandCallback callback;
+
+        void* context;
+
+        int stopped;
+
+    } PngStream;
+
+    // This structure stores a span of the trace of the execution (see 
+    // --trace): what has been done and on which file (if any), when it 
+    // started (since the trace started) and how long it took, in seconds.
+
+    typedef struct {
+
+        const char* name;
+
+        char* filename;
+
+        double start;
+
+        double duration;
+
+    } TraceEvent;
+
+    // This structure maintains the spans recorded by a thread: since each 
+    // thread has its own buffer, no lock is needed to record a span. The 
+    // buffers of all the threads are kept into a list, written at the end.
+
+    typedef struct TraceBuffer {
+
+        int thread;
+
+        TraceEvent* events;
+
+        int count;
+
+        int size;
+
+        struct TraceBuffer* next;
+
+    } TraceBuffer;
+
+    // This structure stores the result of a benchmark (see --benchmark): 
+    // the kernel, the synthetic image it has been run on, the time taken 
+    // for each pixel (in nanoseconds) by the fastest, the median and the 
+    // slowest repetition, and how many bytes of pixels have been read for
+    // each second by the median one (in gigabytes).
+
+    typedef struct {
+
+        char kernel[64];
+
+        char image[16];
+
+        char distribution[16];
+
+        double minimum;
+
+        double median;
+
+        double maximum;
+
+        double throughput;
+
+    } BenchmarkResult;
+
+    // This structure maintains a synthetic image of the corpus (see 
+    // --corpus): its pixels (with three components) and, for images with 
+    // few colors, the index of the color of each pixel and the palette.
+
+    typedef struct {
+
+        int width;
+
+        int height;
+
+        unsigned char* pixels;
+
+        unsigned char* indexes;
+
+        RGB palette[4];
+
+        int colors;
+
+    } CorpusImage;
+
+    // This structure maintains the output of a thread, kept into memory so
+    // that it can be written at once (see print_output).
+
+    typedef struct {
+
+        char* data;
+
+        size_t size;
+
+        size_t used;
+
+    } OutputBuffer;
+
+    // This is a task that can be run in parallel, with its index.
+
+    typedef void (*ParallelTask)(int _index, void* _context);
+
+    // This structure maintains the tasks to be run in parallel, and the 
+    // index of the next task to be taken by a thread.
+
+    typedef struct {
+
+        ParallelTask task;
+
+        void* context;
+
+        int* order;
+
+        int count;
+
+        volatile long next;
+
+    } ParallelWork;
+
 #endif
@@ -5461,7 +5461,7 @@ static void* stbi__bmp_load(stbi__context* s, int* x, int* y, int* comp, int req
     }
     if (psize == 0) {
         STBI_ASSERT(info.offset == s->callback_already_read + (int)(s->img_buffer - s->img_buffer_original));
-        if (info.offset != s->callback_already_read + (s->img_buffer - s->buffer_start)) {
+        if (info.offset != s->callback_already_read + ((int)(s->img_buffer - s->img_buffer_original))) {
             return stbi__errpuc("bad offset", "Corrupt BMP");
         }
     }
@@ -7251,7 +7251,7 @@ static int stbi__bmp_info(stbi__context* s, int* x, int* y, int* comp)
     if (p == NULL)
         return 0;
     if (x) *x = s->img_x;
-    if (y) *y = s->img_y;
+    if (y) *y = abs((int)s->img_y);
     if (comp) {
         if (info.bpp == 24 && info.ma == 0xff000000)
             *comp = 3;